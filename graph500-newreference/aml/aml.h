@@ -7,6 +7,8 @@
    see license.txt or https://opensource.org/licenses/NCSA
 */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,12 +17,29 @@ extern "C" {
 	extern void aml_finalize(void);
 	//barrier which ensures that all AM sent before the barrier are completed everywhere after the barrier
 	extern void aml_barrier( void );
+	//aml_barrier fused with reduction of n int64 values (op is AML_SUM,AML_MIN or AML_MAX)
+	//local values are read after all AM sent before the call were delivered, so handlers may update them
+	//local and global can be the same array
+	extern void aml_barrier_allreduce(const int64_t *local, int64_t *global, int n, int op);
 	//register active message function(collective call)
 	extern void aml_register_handler(void(*f)(int,void*,int),int n);
 	//send AM to another(myself is ok) node
 	//execution of AM might be delayed till next aml_barrier() call
 	extern void aml_send(void *srcaddr, int type,int length, int node );
 
+	//channels: independent aggregation pipelines each with its own flush policy
+	//create channel (collective call, same order on all nodes), returns channel id or -1
+	extern int aml_channel_create(const char *name, int policy, int param);
+	//find channel id by name, -1 if not found
+	extern int aml_channel_lookup(const char *name);
+	//same as aml_send but message is aggregated in given channel
+	extern void aml_send_channel(void *srcaddr, int type,int length, int node, int channel );
+	//start transfer of all messages buffered in channel (non-collective)
+	extern void aml_flush(int channel);
+	//counters of this pe since aml_init: AM sent to other pes, their payload bytes
+	//and seconds spent in reductions of aml_barrier_allreduce
+	extern void aml_get_stats(uint64_t *nmsgs, uint64_t *nbytes, double *treduce);
+
 	// rank and size
 	extern int aml_my_pe( void );
 	extern int aml_n_pes( void );
@@ -29,6 +48,22 @@ extern "C" {
 }
 #endif
 
+//default channel used by aml_send
+#define AML_DEFAULT_CHANNEL 0
+#define AML_MAX_CHANNELS 8
+#define AML_CHANNEL_NAMELEN 32
+
+//channel flush policies, param meaning is given in brackets
+#define AML_FLUSH_AGGREGATE 0 //flush when buffer is full or at aml_barrier()
+#define AML_FLUSH_EAGER 1 //flush after every message
+#define AML_FLUSH_SIZE 2 //flush when buffer for destination holds [param] bytes
+#define AML_FLUSH_TIME 3 //flush when oldest buffered message is [param] microseconds old
+
+//reduction operations for aml_barrier_allreduce
+#define AML_SUM 0
+#define AML_MIN 1
+#define AML_MAX 2
+
 #define my_pe aml_my_pe
 #define num_pes aml_n_pes
 
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <gasnet.h>
 #include <stdbool.h>
+#include <string.h>
 #include <mpi.h>
 
 #include "aml.h"
@@ -24,6 +25,25 @@ struct remote_memory_t
     bool avail;
 };
 
+/* channel with per destination aggregation buffers, packed messages are
+ * delivered by one medium AM and unpacked by aggr_handler */
+struct channel_t
+{
+    char name[AML_CHANNEL_NAMELEN];
+    int policy;
+    int param;
+    double oldest;      /* time of oldest buffered message (AML_FLUSH_TIME) */
+    char *sendbuf;      /* nodes * aggr_size bytes, NULL for eager channels */
+    size_t *sendsize;
+};
+
+struct __attribute__((__packed__)) msg_header_t
+{
+    unsigned short size;
+    unsigned char handler;
+    char pad;
+};
+
 /* node information */
 gasnet_node_t my_node;
 gasnet_node_t nodes;
@@ -32,11 +52,17 @@ gasnet_node_t nodes;
 static struct handler_func_ptr_t handler_fptrs[256];
 gasnet_seginfo_t *seginfo_table;
 struct remote_memory_t *remote_addresses;
+static struct channel_t channels[AML_MAX_CHANNELS];
+static int nchannels = 0;
+static size_t aggr_size;
+static uint64_t stat_msgs, stat_bytes; /* for aml_get_stats */
+static double stat_treduce;
 
 /* handler ids */
 const int short_handler_id = 200;
 const int medlong_handler_id = 201;
 const int long_reply_handler_id = 202;
+const int aggr_handler_id = 203;
 
 /* handlers */
 void short_handler(gasnet_token_t token, int real_id) 
@@ -77,6 +103,75 @@ void long_reply_handler(gasnet_token_t token)
     remote_addresses[src_node].avail = true;
 }
 
+void aggr_handler(gasnet_token_t token, void *buf, size_t size)
+{
+    gasnet_node_t src_node;
+    gasnet_AMGetMsgSource (token , &src_node);
+    
+    size_t i = 0;
+    while( i < size )
+    {
+        struct msg_header_t *h = (struct msg_header_t *)((char *)buf + i);
+        
+        if( !handler_fptrs[h->handler].func_ptr )
+        {
+            fprintf(stderr, "calling non registered handler with id %d on node %d\n", h->handler, my_node);
+            exit(1);
+        }
+        
+        handler_fptrs[h->handler].func_ptr(src_node, (char *)h + sizeof(struct msg_header_t), h->size);
+        i += sizeof(struct msg_header_t) + h->size;
+    }
+}
+
+/* setup channel, aggregation buffers only needed for non eager channels */
+static int channel_init(const char *name, int policy, int param)
+{
+    if( nchannels == AML_MAX_CHANNELS )
+        return -1;
+    
+    struct channel_t *c = &channels[nchannels];
+    strncpy(c->name, name, AML_CHANNEL_NAMELEN-1);
+    c->name[AML_CHANNEL_NAMELEN-1] = '\0';
+    c->policy = policy;
+    c->param = (policy == AML_FLUSH_SIZE && param > aggr_size) ? aggr_size : param;
+    c->oldest = 0.0;
+    c->sendbuf = NULL;
+    c->sendsize = NULL;
+    
+    if( policy != AML_FLUSH_EAGER )
+    {
+        c->sendbuf  = (char *)malloc( nodes*aggr_size );
+        c->sendsize = (size_t *)calloc( nodes, sizeof(size_t) );
+        
+        if( !c->sendbuf || !c->sendsize )
+        {
+            fprintf(stderr, "memory allocation failed\n");
+            exit(1);
+        }
+    }
+    
+    return nchannels++;
+}
+
+static void flush_buffer(struct channel_t *c, gasnet_node_t node)
+{
+    if( c->sendsize == NULL || c->sendsize[node] == 0 )
+        return;
+    
+    /* medium payload is copied, so buffer can be reused right away */
+    gasnet_AMRequestMedium0(node, aggr_handler_id, c->sendbuf + node*aggr_size, c->sendsize[node]);
+    c->sendsize[node] = 0;
+}
+
+static void flush_channel(struct channel_t *c)
+{
+    for(gasnet_node_t i = 1; i < nodes; ++i)
+        flush_buffer(c, (my_node+i) % nodes);
+    
+    c->oldest = 0.0;
+}
+
 /* init GASNet */
 int aml_init(int *argc_ptr,char ***argv_ptr)
 {    
@@ -94,7 +189,8 @@ int aml_init(int *argc_ptr,char ***argv_ptr)
     gasnet_handlerentry_t handlers[] = {
         { short_handler_id,         (void(*)())short_handler },
         { medlong_handler_id,       (void(*)())medlong_handler },
-        { long_reply_handler_id,    (void(*)())long_reply_handler }
+        { long_reply_handler_id,    (void(*)())long_reply_handler },
+        { aggr_handler_id,          (void(*)())aggr_handler }
     };
     
     gasnet_attach(handlers, sizeof(handlers)/sizeof(gasnet_handlerentry_t), segsize, min_heap_offset);
@@ -143,6 +239,10 @@ int aml_init(int *argc_ptr,char ***argv_ptr)
     for(int i=0; i < 256; ++i)
         handler_fptrs[i].func_ptr = NULL;
     
+    /* default channel sends every message directly as before */
+    aggr_size = gasnet_AMMaxMedium();
+    channel_init("default", AML_FLUSH_EAGER, 0);
+    
     BARRIER();
 }
 
@@ -176,14 +276,42 @@ void aml_finalize(void)
     
     if( remote_addresses ) free(remote_addresses);
     if( seginfo_table )    free(seginfo_table);
+    
+    for(int c = 0; c < nchannels; ++c)
+    {
+        if( channels[c].sendbuf )  free(channels[c].sendbuf);
+        if( channels[c].sendsize ) free(channels[c].sendsize);
+    }
 }
 
 void aml_barrier( void )
 {
+    for(int c = 0; c < nchannels; ++c)
+        flush_channel(&channels[c]);
+    
     gasnet_AMPoll();
     BARRIER();
 }
 
+void aml_barrier_allreduce(const int64_t *local, int64_t *global, int n, int op)
+{
+    MPI_Op mpiop = (op == AML_MIN) ? MPI_MIN : (op == AML_MAX) ? MPI_MAX : MPI_SUM;
+    
+    aml_barrier();
+    
+    /* all handlers are done here, reduction replaces additional barriers */
+    double t = MPI_Wtime();
+    MPI_Allreduce(local == global ? MPI_IN_PLACE : (void *)local, global, n, MPI_INT64_T, mpiop, MPI_COMM_WORLD);
+    stat_treduce += MPI_Wtime() - t;
+}
+
+void aml_get_stats(uint64_t *nmsgs, uint64_t *nbytes, double *treduce)
+{
+    *nmsgs = stat_msgs;
+    *nbytes = stat_bytes;
+    *treduce = stat_treduce;
+}
+
 void aml_register_handler(void(*f)(int,void*,int),int n)
 {
     MPI_Barrier(MPI_COMM_WORLD);
@@ -229,6 +357,8 @@ void aml_send(void *srcaddr, int n,int length, int node )
     }
     else
     {
+        stat_msgs++;
+        stat_bytes += length;
         if( length == 0 )
         {
             gasnet_AMRequestShort1(node, short_handler_id, n);
@@ -255,3 +385,63 @@ void aml_send(void *srcaddr, int n,int length, int node )
         }
     }
 }
+
+void aml_send_channel(void *srcaddr, int n, int length, int node, int channel)
+{
+    struct channel_t *c = &channels[channel];
+    
+    if( c->policy == AML_FLUSH_EAGER || node == my_node || length + sizeof(struct msg_header_t) > aggr_size )
+    {
+        aml_send(srcaddr, n, length, node);
+        return;
+    }
+    
+    gasnet_AMPoll();
+    
+    if( c->sendsize[node] + sizeof(struct msg_header_t) + length > aggr_size )
+        flush_buffer(c, node);
+    
+    struct msg_header_t *h = (struct msg_header_t *)(c->sendbuf + node*aggr_size + c->sendsize[node]);
+    h->size = length;
+    h->handler = n;
+    memcpy((char *)h + sizeof(struct msg_header_t), srcaddr, length);
+    c->sendsize[node] += sizeof(struct msg_header_t) + length;
+    stat_msgs++;
+    stat_bytes += length;
+    
+    if( c->policy == AML_FLUSH_SIZE && c->sendsize[node] >= c->param )
+    {
+        flush_buffer(c, node);
+    }
+    else if( c->policy == AML_FLUSH_TIME )
+    {
+        double now = MPI_Wtime();
+        if( c->oldest == 0.0 )
+            c->oldest = now;
+        else if( (now - c->oldest)*1.0e6 >= c->param )
+            flush_channel(c);
+    }
+}
+
+void aml_flush(int channel)
+{
+    flush_channel(&channels[channel]);
+}
+
+int aml_channel_create(const char *name, int policy, int param)
+{
+    aml_barrier();
+    int id = channel_init(name, policy, param);
+    aml_barrier();
+    
+    return id;
+}
+
+int aml_channel_lookup(const char *name)
+{
+    for(int i = 0; i < nchannels; ++i)
+        if( !strncmp(channels[i].name, name, AML_CHANNEL_NAMELEN-1) )
+            return i;
+    
+    return -1;
+}
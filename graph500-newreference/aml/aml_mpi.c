@@ -81,6 +81,7 @@ int pthread_setaffinity_np(pthread_t thread, size_t cpu_size,
 
 #include <unistd.h>
 #include <mpi.h>
+#include "aml.h"
 
 #define MAXGROUPS 65536		//number of nodes (core processes form a group on a same node)
 #define AGGR (1024*32) //aggregation buffer size per dest in bytes : internode
@@ -91,8 +92,10 @@ int pthread_setaffinity_np(pthread_t thread, size_t cpu_size,
 #define NSEND_intra 4 // number of send intranode
 #define SOATTR __attribute__((visibility("default")))
 
-#define SENDSOURCE(node) ( sendbuf+(AGGR*nbuf[node]))
-#define SENDSOURCE_intra(node) ( sendbuf_intra+(AGGR_intra*nbuf_intra[node]) )
+#define CHDR sizeof(int) //internode buffers start with channel id, so forwarding node keeps the channel
+
+#define SENDSOURCE(c,node) ( (c)->sendbuf+(AGGR*(c)->nbuf[node]))
+#define SENDSOURCE_intra(c,node) ( (c)->sendbuf_intra+(AGGR_intra*(c)->nbuf_intra[node]) )
 
 #define ushort unsigned short
 static int myproc,num_procs;
@@ -118,29 +121,42 @@ static void (*aml_handlers[256]) (int,void *,int); //pointers to user-provided A
 //intranode comm (all cores of one nodegroup)
 MPI_Comm comm, comm_intra;
 
-// MPI stuff for sends
-static char *sendbuf; //coalescing buffers, most of memory is allocated is here
-static int *sendsize; //buffer occupacy in bytes
+// channel: own coalescing buffers and sends, acks and recvs are shared by all channels
+typedef struct aml_channel {
+	char name[AML_CHANNEL_NAMELEN];
+	int id,policy,param;
+	double oldest; //time of oldest unflushed message for AML_FLUSH_TIME, 0 if nothing buffered
+	// MPI stuff for sends
+	char *sendbuf; //coalescing buffers, most of memory is allocated is here
+	int *sendsize; //buffer occupacy in bytes
+	ushort *nbuf; //actual buffer for each group/localcore
+	ushort activebuf[NSEND];// N_buffer used in transfer(0..NSEND{_intra}-1)
+	MPI_Request rqsend[NSEND];
+
+	char *sendbuf_intra;
+	int *sendsize_intra;
+	ushort *nbuf_intra;
+	ushort activebuf_intra[NSEND_intra];
+	MPI_Request rqsend_intra[NSEND_intra];
+} aml_channel;
+
+static aml_channel channels[AML_MAX_CHANNELS];
+static int nchannels=0;
+
 static ushort *acks; //aggregated acks
-static ushort *nbuf; //actual buffer for each group/localcore
-static ushort activebuf[NSEND];// N_buffer used in transfer(0..NSEND{_intra}-1)
-static MPI_Request rqsend[NSEND];
 // MPI stuff for recv
 static char recvbuf[AGGR*NRECV];
 static MPI_Request rqrecv[NRECV];
 
 unsigned long long nbytes_sent,nbytes_rcvd;
+static uint64_t stat_msgs,stat_bytes; //for aml_get_stats
+static double stat_treduce;
 
-static char *sendbuf_intra;
-static int *sendsize_intra;
 static ushort *acks_intra;
-static ushort *nbuf_intra;
-static ushort activebuf_intra[NSEND_intra];
-static MPI_Request rqsend_intra[NSEND_intra];
 static char recvbuf_intra[AGGR_intra*NRECV_intra];
 static MPI_Request rqrecv_intra[NRECV_intra];
 volatile static int ack_intra=0;
-inline void aml_send_intra(void *srcaddr, int type, int length, int local ,int from);
+inline void aml_send_intra(aml_channel *c,void *srcaddr, int type, int length, int local ,int from);
 
 void aml_finalize(void);
 void aml_barrier(void);
@@ -154,8 +170,9 @@ struct __attribute__((__packed__)) hdr { //header of internode message
 };
 //process internode messages
 static void process(int fromgroup,int length ,char* message) {
-	int i = 0;
+	int i = CHDR;
 	int from = PROC_FROM_GROUPLOCAL(fromgroup,mylocal);
+	aml_channel *c = &channels[*(int*)message];
 	while ( i < length ) {
 		void* m = message+i;
 		struct hdr *h = m;
@@ -165,7 +182,7 @@ static void process(int fromgroup,int length ,char* message) {
 		if(destlocal == mylocal)
 			aml_handlers[hndl](from,m+sizeof(struct hdr),hsz);
 		else
-			aml_send_intra(m+sizeof(struct hdr),hndl,hsz,destlocal,from);
+			aml_send_intra(c,m+sizeof(struct hdr),hndl,hsz,destlocal,from);
 		i += hsz + sizeof(struct hdr);
 	}
 }
@@ -232,57 +249,89 @@ static void aml_poll(void) {
 }
 
 //flush internode buffer to destination node
-inline void flush_buffer( int node ) {
+inline void flush_buffer( aml_channel *c, int node ) {
 	MPI_Status stsend;
 	int flag=0,index,tmp;
-	if (sendsize[node] == 0 && acks[node]==0 ) return;
+	int size = c->sendsize[node] > CHDR ? c->sendsize[node] : 0; //channel id alone is not sent
+	if (size == 0 && acks[node]==0 ) return;
 	while (!flag) {
 		aml_poll();
-		MPI_Testany(NSEND,rqsend,&index,&flag,&stsend);
+		MPI_Testany(NSEND,c->rqsend,&index,&flag,&stsend);
 	}
-	MPI_Isend(SENDSOURCE(node), sendsize[node], MPI_CHAR,node, acks[node], comm, rqsend+index );
-	nbytes_sent+=sendsize[node];
-	if (sendsize[node] > 0) ack++;
-	sendsize[node] = 0;
+	//forwarded messages processed by aml_poll may have flushed this buffer already
+	size = c->sendsize[node] > CHDR ? c->sendsize[node] : 0;
+	MPI_Isend(SENDSOURCE(c,node), size, MPI_CHAR,node, acks[node], comm, c->rqsend+index );
+	nbytes_sent+=size;
+	if (size > 0) ack++;
+	c->sendsize[node] = CHDR;
 	acks[node] = 0;
-	tmp=activebuf[index]; activebuf[index]=nbuf[node]; nbuf[node]=tmp; //swap bufs
+	tmp=c->activebuf[index]; c->activebuf[index]=c->nbuf[node]; c->nbuf[node]=tmp; //swap bufs
 
 }
 //flush intranode buffer, NB:node is local number of pe in group
-inline void flush_buffer_intra( int node ) {
+inline void flush_buffer_intra( aml_channel *c, int node ) {
 	MPI_Status stsend;
 	int flag=0,index,tmp;
-	if (sendsize_intra[node] == 0 && acks_intra[node]==0 ) return;
+	if (c->sendsize_intra[node] == 0 && acks_intra[node]==0 ) return;
 	while (!flag) {
 		aml_poll_intra();
-		MPI_Testany(NSEND_intra,rqsend_intra,&index,&flag,&stsend);
+		MPI_Testany(NSEND_intra,c->rqsend_intra,&index,&flag,&stsend);
 	}
-	MPI_Isend( SENDSOURCE_intra(node), sendsize_intra[node], MPI_CHAR,
-			node, acks_intra[node], comm_intra, rqsend_intra+index );
-	if (sendsize_intra[node] > 0) ack_intra++;
-	sendsize_intra[node] = 0;
+	MPI_Isend( SENDSOURCE_intra(c,node), c->sendsize_intra[node], MPI_CHAR,
+			node, acks_intra[node], comm_intra, c->rqsend_intra+index );
+	if (c->sendsize_intra[node] > 0) ack_intra++;
+	c->sendsize_intra[node] = 0;
 	acks_intra[node] = 0;
-	tmp=activebuf_intra[index]; activebuf_intra[index]=nbuf_intra[node]; nbuf_intra[node]=tmp; //swap bufs
+	tmp=c->activebuf_intra[index]; c->activebuf_intra[index]=c->nbuf_intra[node]; c->nbuf_intra[node]=tmp; //swap bufs
+
+}
 
+//flush all buffers of a channel
+static void flush_channel( aml_channel *c ) {
+	int i;
+	c->oldest=0.0; //cleared first: flushes poll and may forward messages to this channel
+	for ( i = 1; i < num_groups; i++ )
+		flush_buffer(c,(mygroup+i)%num_groups);
+	for ( i = 1; i < group_size; i++ )
+		flush_buffer_intra(c,LOCAL_FROM_PROC(mylocal+i));
 }
 
-inline void aml_send_intra(void *src, int type, int length, int local, int from) {
+//check channel policy after message of was put to buffer of size bytes
+static void check_policy( aml_channel *c, int size, int node, int intra ) {
+	switch(c->policy) {
+		case AML_FLUSH_EAGER:
+			if(intra) flush_buffer_intra(c,node); else flush_buffer(c,node);
+			break;
+		case AML_FLUSH_SIZE:
+			if(size >= c->param) { if(intra) flush_buffer_intra(c,node); else flush_buffer(c,node); }
+			break;
+		case AML_FLUSH_TIME: {
+			double now = MPI_Wtime();
+			if(c->oldest==0.0) c->oldest=now;
+			else if((now-c->oldest)*1.0e6 >= c->param) flush_channel(c);
+			break;
+		}
+	}
+}
+
+inline void aml_send_intra(aml_channel *c, void *src, int type, int length, int local, int from) {
 	//send to _another_ process from same group
-	int nmax = AGGR_intra - sendsize_intra[local] - sizeof(struct hdri);
+	int nmax = AGGR_intra - c->sendsize_intra[local] - sizeof(struct hdri);
 	if ( nmax < length ) {
-		flush_buffer_intra(local);
+		flush_buffer_intra(c,local);
 	}
-	char* dst = (SENDSOURCE_intra(local)+sendsize_intra[local]);
+	char* dst = (SENDSOURCE_intra(c,local)+c->sendsize_intra[local]);
 	struct hdri *h=(void*)dst;
 	h->routing = GROUP_FROM_PROC(from);
 	h->sz=length;
 	h->hndl = type;
-	sendsize_intra[local] += length+sizeof(struct hdri);
+	c->sendsize_intra[local] += length+sizeof(struct hdri);
 
 	memcpy(dst+sizeof(struct hdri),src,length);
+	if(c->policy != AML_FLUSH_AGGREGATE) check_policy(c,c->sendsize_intra[local],local,1);
 }
 
-SOATTR void aml_send(void *src, int type,int length, int node ) {
+static inline void send_channel(aml_channel *c, void *src, int type,int length, int node ) {
 	
 #ifdef PRINT_MSG_DATA
     if(length % sizeof(int) == 0)
@@ -295,28 +344,102 @@ SOATTR void aml_send(void *src, int type,int length, int node ) {
     
     if ( node == myproc )
 		return aml_handlers[type](myproc,src,length);
+	stat_msgs++; stat_bytes+=length;
 
 	int group = GROUP_FROM_PROC(node);
 	int local = LOCAL_FROM_PROC(node);
 
 	//send to another node in my group
 	if ( group == mygroup )
-		return aml_send_intra(src,type,length,local,myproc);
+		return aml_send_intra(c,src,type,length,local,myproc);
 
 	//send to another group
-	int nmax = AGGR - sendsize[group]-sizeof(struct hdr);
+	int nmax = AGGR - c->sendsize[group]-sizeof(struct hdr);
 	if ( nmax < length ) {
-		flush_buffer(group);
+		flush_buffer(c,group);
 	}
-	char* dst = (SENDSOURCE(group)+sendsize[group]);
+	char* dst = (SENDSOURCE(c,group)+c->sendsize[group]);
 	struct hdr *h=(void*)dst;
 	h->routing = local;
 	h->hndl = type;
 	h->sz=length;
-	sendsize[group] += length+sizeof(struct hdr);
+	c->sendsize[group] += length+sizeof(struct hdr);
 	memcpy(dst+sizeof(struct hdr),src,length);
+	if(c->policy != AML_FLUSH_AGGREGATE) check_policy(c,c->sendsize[group]-CHDR,group,0);
+}
+
+SOATTR void aml_send(void *src, int type,int length, int node ) {
+	send_channel(&channels[AML_DEFAULT_CHANNEL],src,type,length,node);
+}
+
+SOATTR void aml_send_channel(void *src, int type,int length, int node, int channel ) {
+	send_channel(&channels[channel],src,type,length,node);
 }
 
+SOATTR void aml_flush(int channel) {
+	flush_channel(&channels[channel]);
+}
+
+//allocate coalescing buffers and start dummy sends for a new channel
+static int channel_init(const char *name, int policy, int param) {
+	int i,j;
+	if(nchannels==AML_MAX_CHANNELS) return -1;
+	aml_channel *c = &channels[nchannels];
+	strncpy(c->name,name,AML_CHANNEL_NAMELEN-1);
+	c->name[AML_CHANNEL_NAMELEN-1]='\0';
+	c->id=nchannels;
+	c->policy=policy;
+	c->param=policy==AML_FLUSH_SIZE && param>AGGR ? AGGR : param;
+	c->oldest=0.0;
+
+	c->sendbuf = malloc( AGGR*(num_groups+NSEND));
+	if ( !c->sendbuf ) return -1;
+	memset(c->sendbuf,0,AGGR*(num_groups+NSEND));
+	for(i=0;i<num_groups+NSEND;i++) *(int*)(c->sendbuf+AGGR*i)=c->id; //all buffers of channel carry its id
+	c->sendsize = malloc( num_groups*sizeof(*c->sendsize) );
+	if (!c->sendsize) return -1;
+	c->nbuf = malloc( num_groups*sizeof(*c->nbuf) );
+	if (!c->nbuf) return -1;
+
+	c->sendbuf_intra = malloc( AGGR_intra*(group_size+NSEND_intra));
+	if ( !c->sendbuf_intra ) return -1;
+	memset(c->sendbuf_intra,0,AGGR_intra*(group_size+NSEND_intra));
+	c->sendsize_intra = malloc( group_size*sizeof(*c->sendsize_intra) );
+	if (!c->sendsize_intra) return -1;
+	c->nbuf_intra = malloc( group_size*sizeof(*c->nbuf_intra) );
+	if (!c->nbuf_intra) return -1;
+	for ( j = 0; j < group_size; j++ ) {
+		c->sendsize_intra[j] = 0; c->nbuf_intra[j] = j;
+	}
+	for ( j = 0; j < NSEND_intra; j++ ) {
+		MPI_Isend( NULL, 0, MPI_CHAR, MPI_PROC_NULL, 0, comm_intra, c->rqsend_intra+j );
+		c->activebuf_intra[j]=group_size+j;
+	}
+
+	for ( j = 0; j < num_groups; j++ ) {
+		c->sendsize[j] = CHDR; c->nbuf[j] = j;
+	}
+	for ( j = 0; j < NSEND; j++ ) {
+		MPI_Isend( NULL, 0, MPI_CHAR, MPI_PROC_NULL, 0, comm, c->rqsend+j );
+		c->activebuf[j]=num_groups+j;
+	}
+	return nchannels++;
+}
+
+SOATTR int aml_channel_create(const char *name, int policy, int param) {
+	int id;
+	aml_barrier();
+	id=channel_init(name,policy,param);
+	aml_barrier(); //nobody sends to the channel before it exists everywhere
+	return id;
+}
+
+SOATTR int aml_channel_lookup(const char *name) {
+	int i;
+	for(i=0;i<nchannels;i++)
+		if(!strncmp(channels[i].name,name,AML_CHANNEL_NAMELEN-1)) return i;
+	return -1;
+}
 
 int stringCmp( const void *a, const void *b)
 { return strcmp(a,b);  }
@@ -325,11 +448,23 @@ int stringCmp( const void *a, const void *b)
 SOATTR int aml_init( int *argc, char ***argv ) {
 	int r, i, j,tmpmax;
 
+#ifdef _OPENMP
+	//threaded users call AML from one thread at a time
+	int provided;
+	r = MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &provided);
+#else
 	r = MPI_Init(argc, argv);
+#endif
 	if ( r != MPI_SUCCESS ) return r;
 
 	MPI_Comm_size( MPI_COMM_WORLD, &num_procs );
 	MPI_Comm_rank( MPI_COMM_WORLD, &myproc );
+#ifdef _OPENMP
+	if ( provided < MPI_THREAD_SERIALIZED ) {
+		if(myproc==0) printf("AML: Fatal: MPI provides thread level %d, OpenMP build needs MPI_THREAD_SERIALIZED\n",provided);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+#endif
 
 	//split communicator
 	char host_name[MPI_MAX_PROCESSOR_NAME];
@@ -395,61 +530,42 @@ SOATTR int aml_init( int *argc, char ***argv ) {
 		r = MPI_Recv_init( recvbuf+AGGR*i, AGGR, MPI_CHAR,MPI_ANY_SOURCE, MPI_ANY_TAG, comm,rqrecv+i );
 		if ( r != MPI_SUCCESS ) return r;
 	}
-	sendbuf = malloc( AGGR*(num_groups+NSEND));
-	if ( !sendbuf ) return -1;
-	memset(sendbuf,0,AGGR*(num_groups+NSEND));
-	sendsize = malloc( num_groups*sizeof(*sendsize) );
-	if (!sendsize) return -1;
 	acks = malloc( num_groups*sizeof(*acks) );
 	if (!acks) return -1;
-	nbuf = malloc( num_groups*sizeof(*nbuf) );
-	if (!nbuf) return -1;
 
 
 	for(i=0;i<NRECV_intra;i++)  {
 		r = MPI_Recv_init( recvbuf_intra+AGGR_intra*i, AGGR_intra, MPI_CHAR,MPI_ANY_SOURCE, MPI_ANY_TAG, comm_intra,rqrecv_intra+i );
 		if ( r != MPI_SUCCESS ) return r;
 	}
-	sendbuf_intra = malloc( AGGR_intra*(group_size+NSEND_intra));
-	if ( !sendbuf_intra ) return -1;
-	memset(sendbuf_intra,0,AGGR_intra*(group_size+NSEND_intra));
-	sendsize_intra = malloc( group_size*sizeof(*sendsize_intra) );
-	if (!sendsize_intra) return -1;
 	acks_intra = malloc( group_size*sizeof(*acks_intra) );
 	if (!acks_intra) return -1;
-	nbuf_intra = malloc( group_size*sizeof(*nbuf_intra) );
-	if (!nbuf_intra) return -1;
-	for ( j = 0; j < group_size; j++ ) {
-		sendsize_intra[j] = 0; nbuf_intra[j] = j; acks_intra[j]=0;
-	}
+	for ( j = 0; j < group_size; j++ )
+		acks_intra[j]=0;
 	for(i=0;i<NRECV_intra;i++)
 		MPI_Start(rqrecv_intra+i);
 
-	for ( j = 0; j < NSEND_intra; j++ ) {
-		MPI_Isend( NULL, 0, MPI_CHAR, MPI_PROC_NULL, 0, comm_intra, rqsend_intra+j );
-		activebuf_intra[j]=group_size+j;
-	}
-
-	for ( j = 0; j < num_groups; j++ ) {
-		sendsize[j] = 0; nbuf[j] = j;  acks[j]=0;
-	}
+	for ( j = 0; j < num_groups; j++ )
+		acks[j]=0;
 	for(i=0;i<NRECV;i++)
 		MPI_Start( rqrecv+i );
-	for ( j = 0; j < NSEND; j++ ) {
-		MPI_Isend( NULL, 0, MPI_CHAR, MPI_PROC_NULL, 0, comm, rqsend+j );
-		activebuf[j]=num_groups+j;
-	}
+
+	if(channel_init("default",AML_FLUSH_AGGREGATE,0)!=AML_DEFAULT_CHANNEL) return -1;
 	return 0;
 }
 
-SOATTR void aml_barrier( void ) {
-	int i,flag;
+//steps of aml_barrier that ensure delivery of all AM, without final synchronization
+static void deliver_all( void ) {
+	int i,c,flag;
 	MPI_Request hndl;
 	inbarrier++;
-	//1. flush internode buffers
-	for ( i = 1; i < num_groups; i++ ) {
-		int group=(mygroup+i)%num_groups;
-		flush_buffer(group);
+	//1. flush internode buffers of all channels
+	for ( c = 0; c < nchannels; c++ ) {
+		for ( i = 1; i < num_groups; i++ ) {
+			int group=(mygroup+i)%num_groups;
+			flush_buffer(&channels[c],group);
+		}
+		channels[c].oldest=0.0;
 	}
 	//2. wait for all internode being acknowledged
 	while(ack!=0) aml_poll();
@@ -461,11 +577,12 @@ SOATTR void aml_barrier( void ) {
 		MPI_Test(&hndl,&flag,MPI_STATUS_IGNORE); aml_poll(); }
 	// NB: All internode received here. I can receive some more intranode.
 
-	//5. Flush all intranode buffers
-	for ( i = 1; i < group_size; i++ ) {
-		int localproc=LOCAL_FROM_PROC(mylocal+i);
-		flush_buffer_intra(localproc);
-	}
+	//5. Flush all intranode buffers of all channels
+	for ( c = 0; c < nchannels; c++ )
+		for ( i = 1; i < group_size; i++ ) {
+			int localproc=LOCAL_FROM_PROC(mylocal+i);
+			flush_buffer_intra(&channels[c],localproc);
+		}
 	//inbarrier=2;
 	//6. wait for all intranode being acknowledged
 	while(ack_intra!=0) aml_poll_intra();
@@ -476,11 +593,28 @@ SOATTR void aml_barrier( void ) {
 	while(flag==0) {
 		MPI_Test(&hndl,&flag,MPI_STATUS_IGNORE); aml_poll_intra(); }
 	inbarrier--;
+}
+
+SOATTR void aml_barrier( void ) {
+	deliver_all();
 	MPI_Barrier(MPI_COMM_WORLD);
 }
 
+SOATTR void aml_barrier_allreduce(const int64_t *local, int64_t *global, int n, int op) {
+	MPI_Op mpiop = op==AML_MIN ? MPI_MIN : op==AML_MAX ? MPI_MAX : MPI_SUM;
+	deliver_all();
+	//all handlers are done here, reduction replaces final barrier
+	double t=MPI_Wtime();
+	MPI_Allreduce(local==global ? MPI_IN_PLACE : (void*)local,global,n,MPI_INT64_T,mpiop,MPI_COMM_WORLD);
+	stat_treduce+=MPI_Wtime()-t;
+}
+
+SOATTR void aml_get_stats(uint64_t *nmsgs, uint64_t *nbytes, double *treduce) {
+	*nmsgs=stat_msgs; *nbytes=stat_bytes; *treduce=stat_treduce;
+}
+
 SOATTR void aml_finalize( void ) {
-	int i;
+	int i,c;
 	aml_barrier();
 	for(i=0;i<NRECV;i++)
 		MPI_Cancel(rqrecv+i);
@@ -488,10 +622,12 @@ SOATTR void aml_finalize( void ) {
 	for(i=0;i<NRECV_intra;i++)
 		MPI_Cancel(rqrecv_intra+i);
 	MPI_Status stat_intra[NSEND_intra];
-	MPI_Waitall(NSEND_intra,rqsend_intra,stat_intra);
+	for(c=0;c<nchannels;c++)
+		MPI_Waitall(NSEND_intra,channels[c].rqsend_intra,stat_intra);
 #endif
 	MPI_Status stat[NSEND];
-	MPI_Waitall(NSEND,rqsend,stat);
+	for(c=0;c<nchannels;c++)
+		MPI_Waitall(NSEND,channels[c].rqsend,stat);
 	MPI_Finalize();
 }
 
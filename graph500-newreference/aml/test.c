@@ -14,6 +14,16 @@ void set_global_double(int src_node, void *buf, int size)
 
 const int id = 4;
 
+long long nreceived;
+
+void count_message(int src_node, void *buf, int size)
+{
+    nreceived++;
+}
+
+const int count_id = 5;
+const int nstress = 200000;
+
 int main(int argc, char **argv)
 {
     aml_init(&argc, &argv);
@@ -27,6 +37,16 @@ int main(int argc, char **argv)
     
     aml_barrier();
     
+    int control = aml_channel_create("control", AML_FLUSH_EAGER, 0);
+    send_value += 1.0;
+    aml_send_channel(&send_value, id, sizeof(double), neighbour, control);
+    aml_flush(control);
+    
+    aml_barrier();
+    
+    if( aml_channel_lookup("control") != control )
+        printf("channel lookup failed on node %d\n", aml_my_pe());
+    
     long long sum_nodes = aml_my_pe();
     long long max_nodes = aml_my_pe();
     long long min_nodes = aml_my_pe();
@@ -35,7 +55,38 @@ int main(int argc, char **argv)
     aml_long_allmax(&max_nodes);
     aml_long_allmin(&min_nodes);
     
+    int64_t fused[3] = { aml_my_pe(), aml_my_pe(), aml_my_pe() };
+    aml_barrier_allreduce(fused, fused, 1, AML_SUM);
+    aml_barrier_allreduce(fused+1, fused+1, 1, AML_MIN);
+    aml_barrier_allreduce(fused+2, fused+2, 1, AML_MAX);
+    
+    if( fused[0] != sum_nodes || fused[1] != min_nodes || fused[2] != max_nodes )
+        printf("aml_barrier_allreduce failed on node %d\n", aml_my_pe());
+    
+    aml_barrier();
+    
+    uint64_t nmsgs, nbytes;
+    double treduce;
+    aml_get_stats(&nmsgs, &nbytes, &treduce);
+    uint64_t expected = neighbour == aml_my_pe() ? 0 : 2;
+    if( nmsgs != expected || nbytes != expected*sizeof(double) || treduce < 0.0 )
+        printf("aml_get_stats failed on node %d\n", aml_my_pe());
+    
+    // time policy flushing on every message: across nodes messages are forwarded by
+    // intermediate processes, whose polling inside a flush sends to the same channel again
+    aml_register_handler(count_message, count_id);
+    int timed = aml_channel_create("timed", AML_FLUSH_TIME, 0);
+    int i, stress_value = 0;
+    aml_barrier();
+    if( aml_n_pes() > 1 )
+        for( i = 0; i < nstress; i++ )
+            aml_send_channel(&stress_value, count_id, sizeof(int), (aml_my_pe() + 1 + i % (aml_n_pes() - 1)) % aml_n_pes(), timed);
+    aml_flush(timed);
     aml_barrier();
+    long long nstressed = nreceived;
+    aml_long_allsum(&nstressed);
+    if( aml_n_pes() > 1 && nstressed != (long long)nstress * aml_n_pes() )
+        printf("timed channel delivered %lld of %lld messages on node %d\n", nstressed, (long long)nstress * aml_n_pes(), aml_my_pe());
     
     if( aml_my_pe() == 0 )
     {
@@ -0,0 +1,160 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Graph500: Kernel 2: BFS
+// Multi-source BFS: up to BATCH_LANES roots traversed together, one bit lane per root.
+// Visit messages carry lane masks, so levels, barriers and messages are shared by all roots.
+// Only depth of each newly reached lane is recorded, predecessors of one root are recovered
+// afterwards by one pass of messages over edges of the lane. Uses 1D CSR of bfs_reference.c
+
+#include "common.h"
+#include "aml.h"
+#include "csr_reference.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+//memory is BATCH_LANES bytes per vertex for depths, fewer lanes run more batches
+#ifndef BATCH_LANES
+#define BATCH_LANES 64
+#endif
+#if BATCH_LANES > 64
+#error "BATCH_LANES can be at most 64, lanes are bits of uint64_t masks"
+#endif
+
+extern oned_csr_graph g;
+extern int64_t *column,*pred_glob;
+extern unsigned int *rowstarts;
+extern int64_t tepsedges; //read by get_edge_count_for_teps
+
+static uint64_t *seen,*frontier,*next; //lane masks for each local vertex
+//depth of vertex v in lane l is lanedepth[v*BATCH_LANES+l] modulo 256: depths of neighbours
+//differ at most by one, so it is enough to tell parents (depth-1) from other neighbours
+static uint8_t *lanedepth;
+static uint8_t level; //current level modulo 256
+static int64_t nextc; //local vertices with new lanes in next level
+static int64_t laneedges[BATCH_LANES]; //degree sum of vertices reached in each lane
+static int64_t laneroots[BATCH_LANES];
+static int nbatch,predlane;
+
+typedef struct lanemsg {
+	uint64_t mask; //lanes of sender in current level
+	int vloc;
+} lanemsg;
+
+typedef struct predmsg {
+	int vloc;
+	int vfrom;
+	uint8_t depth; //depth of sender plus one
+} predmsg;
+
+//AM-handler for visit of several lanes at once
+static void lanehndl(int from,void* data,int sz) {
+	lanemsg *m = data;
+	uint64_t newlanes = m->mask & ~seen[m->vloc];
+	if(newlanes) {
+		if(!next[m->vloc]) nextc++;
+		seen[m->vloc] |= newlanes;
+		next[m->vloc] |= newlanes;
+		while(newlanes) {
+			lanedepth[(size_t)m->vloc*BATCH_LANES+__builtin_ctzll(newlanes)] = level+1;
+			laneedges[__builtin_ctzll(newlanes)] += INPUT_DEGREE(g,m->vloc);
+			newlanes &= newlanes-1;
+		}
+	}
+}
+
+//traverse from first BATCH_LANES of roots at once, returns number of roots taken
+//results are taken by get_bfs_batch_pred
+int run_bfs_batch(int nroots, const int64_t* roots) {
+	int64_t sum=1,i,j,end;
+	int l;
+	if(nroots > BATCH_LANES) nroots = BATCH_LANES;
+	aml_register_handler(lanehndl,1);
+
+	if(!seen) {
+		seen = xmalloc(g.nlocalverts*sizeof(uint64_t));
+		frontier = xmalloc(g.nlocalverts*sizeof(uint64_t));
+		next = xmalloc(g.nlocalverts*sizeof(uint64_t));
+		lanedepth = xmalloc(g.nlocalverts*BATCH_LANES);
+	}
+	memset(seen,0,g.nlocalverts*sizeof(uint64_t));
+	memset(frontier,0,g.nlocalverts*sizeof(uint64_t));
+	memset(next,0,g.nlocalverts*sizeof(uint64_t));
+	nbatch=nroots;
+	level=0;
+	memset(laneedges,0,sizeof(laneedges));
+
+	for(l=0;l<nroots;l++) laneroots[l]=roots[l];
+	for(l=0;l<nroots;l++)
+		if(VERTEX_OWNER(roots[l]) == rank) {
+			seen[VERTEX_LOCAL(roots[l])] |= 1ULL << l;
+			frontier[VERTEX_LOCAL(roots[l])] |= 1ULL << l;
+			lanedepth[VERTEX_LOCAL(roots[l])*BATCH_LANES+l] = 0;
+			laneedges[l] = INPUT_DEGREE(g,VERTEX_LOCAL(roots[l]));
+		}
+
+	// While any lane has vertices in current level
+	while(sum) {
+		nextc=0;
+		for(i=0;i<g.nlocalverts;i++)
+			if(frontier[i])
+				for(j=ROWSTART(g,i),end=ROWEND(g,i);j<end;j++) {
+					int64_t v = COLUMN(j);
+					lanemsg m = {frontier[i],VERTEX_LOCAL(v)};
+					aml_send(&m,1,sizeof(lanemsg),VERTEX_OWNER(v));
+				}
+		aml_barrier_allreduce(&nextc,&sum,1,AML_SUM);
+
+		uint64_t *tmp=frontier;frontier=next;next=tmp;
+		memset(next,0,g.nlocalverts*sizeof(uint64_t));
+		level++;
+	}
+	aml_barrier();
+	return nroots;
+}
+
+//AM-handler: sender is a parent if its depth is one less than depth of the target
+static void predhndl(int from,void* data,int sz) {
+	predmsg *m = data;
+	if(pred_glob[m->vloc] == -1 && (seen[m->vloc] & (1ULL << predlane)) && lanedepth[(size_t)m->vloc*BATCH_LANES+predlane] == m->depth)
+		pred_glob[m->vloc] = VERTEX_TO_GLOBAL(from,m->vfrom);
+}
+
+//fill pred (cleaned by clean_pred) with BFS tree of idx-th root of last batch,
+//collective: every vertex of the lane offers itself as parent to its neighbours
+void get_bfs_batch_pred(int idx, int64_t* pred) {
+	int64_t i,j,end;
+	assert(idx < nbatch);
+	pred_glob=pred;
+	predlane=idx;
+	tepsedges=laneedges[idx]; //for get_edge_count_for_teps
+	aml_register_handler(predhndl,1);
+	if(VERTEX_OWNER(laneroots[idx]) == rank)
+		pred[VERTEX_LOCAL(laneroots[idx])] = laneroots[idx];
+	for(i=0;i<g.nlocalverts;i++)
+		if(seen[i] & (1ULL << idx)) {
+			predmsg m = {0,i,lanedepth[i*BATCH_LANES+idx]+1};
+			for(j=ROWSTART(g,i),end=ROWEND(g,i);j<end;j++) {
+				int64_t v = COLUMN(j);
+				m.vloc = VERTEX_LOCAL(v);
+				aml_send(&m,1,sizeof(predmsg),VERTEX_OWNER(v));
+			}
+		}
+	aml_barrier();
+}
+
+void free_bfs_batch(void) {
+	free(seen); free(frontier); free(next); free(lanedepth);
+	seen=NULL;
+}
@@ -1,4 +1,15 @@
-//Stub for custom BFS implementations
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Graph500: Kernel 2: BFS
+// Direction-optimizing BFS: top-down levels send visits as Active Messages,
+// bottom-up levels scan unvisited vertices against allgathered frontier bitmap
 
 #include "common.h"
 #include "aml.h"
@@ -12,47 +23,196 @@
 #include <limits.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
+
+//switch to bottom-up when frontier edges exceed unexplored edges / BFS_ALPHA
+#ifndef BFS_ALPHA
+#define BFS_ALPHA 14
+#endif
+//switch back to top-down when frontier gets smaller than nglobalverts / BFS_BETA
+#ifndef BFS_BETA
+#define BFS_BETA 24
+#endif
+
+#ifdef DEBUGSTATS
+extern int64_t nbytes_sent,nbytes_rcvd;
+#endif
+// two arrays holding visited VERTEX_LOCALs for current and next level
+// we swap pointers each time
+int *q1,*q2;
+int64_t qc; //size of current level
+enum { NEXT_N, NEXT_M, NEXT_LAST };
+int64_t nextlvl[NEXT_LAST]; //vertices put to q2 and sum of their degrees, updated by handler
+int64_t tepsedges; //degree sum of vertices reached by this pe, each traversed edge is in it twice
 
 //VISITED bitmap parameters
 unsigned long *visited;
 int64_t visited_size;
 
+//frontier bitmap: own part and allgathered copy of all parts for bottom-up levels
+unsigned long *frontier,*frontier_glob;
+int64_t frontier_words; //words of frontier bitmap per pe, same on all pes
+#define SET_FRONTIERLOC(v) do {frontier[(v) ulong_shift] |= (1UL << ((v) ulong_mask));} while (0)
+#define TEST_FRONTIER(v) ((frontier_glob[VERTEX_OWNER(v)*frontier_words + (VERTEX_LOCAL(v) ulong_shift)] & (1UL << (VERTEX_LOCAL(v) ulong_mask))) != 0)
+
+int64_t nglobaledges_csr; //sum of degrees over all vertices
+#ifdef SSSP
+//in sssp_custom.c
+void make_sssp_data_structure(void);
+void free_sssp_data_structure(void);
+#endif
+
+//global variables of CSR graph to be used inside of AM-handlers
 int64_t *pred_glob,*column;
-int *rowstarts;
+unsigned int *rowstarts;
+int64_t *rowbase;
 oned_csr_graph g;
 
+typedef struct visitmsg {
+	//both vertexes are VERTEX_LOCAL components as we know src and dest PEs to reconstruct VERTEX_GLOBAL
+	int vloc;
+	int vfrom;
+} visitmsg;
+
+//AM-handler for check&visit
+void visithndl(int from,void* data,int sz) {
+	visitmsg *m = data;
+	if (!TEST_VISITEDLOC(m->vloc)) {
+		SET_VISITEDLOC(m->vloc);
+		q2[nextlvl[NEXT_N]++] = m->vloc;
+		nextlvl[NEXT_M] += INPUT_DEGREE(g,m->vloc);
+		pred_glob[m->vloc] = VERTEX_TO_GLOBAL(from,m->vfrom);
+	}
+}
+
+static inline void send_visit(int64_t glob, int from) {
+	visitmsg m = {VERTEX_LOCAL(glob),from};
+	aml_send(&m,1,sizeof(visitmsg),VERTEX_OWNER(glob));
+}
+
+//top-down step: visit all neighbours of the frontier by active messages
+static void top_down_step(void) {
+	unsigned int i;
+	size_t j,end;
+	for(i=0;i<qc;i++)
+		for(j=ROWSTART(g,q1[i]),end=ROWEND(g,q1[i]);j<end;j++)
+			send_visit(COLUMN(j),q1[i]);
+}
+
+//bottom-up step: each unvisited vertex looks for a parent in the frontier, no messages sent
+static void bottom_up_step(void) {
+	unsigned int i;
+	size_t j,end;
+	memset(frontier,0,frontier_words*sizeof(unsigned long));
+	for(i=0;i<qc;i++)
+		SET_FRONTIERLOC(q1[i]);
+	MPI_Allgather(frontier,frontier_words,MPI_UNSIGNED_LONG,frontier_glob,frontier_words,MPI_UNSIGNED_LONG,MPI_COMM_WORLD);
+
+	for(i=0;i<g.nlocalverts;i++)
+		if(!TEST_VISITEDLOC(i))
+			for(j=ROWSTART(g,i),end=ROWEND(g,i);j<end;j++)
+				if(TEST_FRONTIER(COLUMN(j))) {
+					SET_VISITEDLOC(i);
+					q2[nextlvl[NEXT_N]++] = i;
+					nextlvl[NEXT_M] += INPUT_DEGREE(g,i);
+					pred_glob[i] = COLUMN(j);
+					break; //first frontier neighbour is enough
+				}
+}
+
 //user should provide this function which would be called once to do kernel 1: graph convert
 void make_graph_data_structure(const tuple_graph* const tg) {
-	//graph conversion, can be changed by user by replacing oned_csr.{c,h} with new graph format 
+	int i;
+	//graph conversion, can be changed by user by replacing oned_csr.{c,h} with new graph format
 	convert_graph_to_oned_csr(tg, &g);
 
 	column=g.column;
+	rowstarts=g.rowstarts;
+	rowbase=g.rowbase;
 	visited_size = (g.nlocalverts + ulong_bits - 1) / ulong_bits;
 	visited = xmalloc(visited_size*sizeof(unsigned long));
-	//user code to allocate other buffers for bfs
+	aml_register_handler(visithndl,1);
+	q1 = xmalloc(g.nlocalverts*sizeof(int)); //100% of vertexes
+	q2 = xmalloc(g.nlocalverts*sizeof(int));
+	for(i=0;i<g.nlocalverts;i++) q1[i]=0,q2[i]=0; //touch memory
+
+	//nlocalverts differs by one between pes, allgather needs same count everywhere
+	frontier_words=visited_size;
+	aml_long_allmax(&frontier_words);
+	frontier = xcalloc(frontier_words,sizeof(unsigned long));
+	frontier_glob = xmalloc(frontier_words*num_pes()*sizeof(unsigned long));
+
+	nglobaledges_csr = g.nlocaledges;
+	aml_long_allsum(&nglobaledges_csr);
+#ifdef SSSP
+	make_sssp_data_structure();
+#endif
 }
 
 //user should provide this function which would be called several times to do kernel 2: breadth first search
 //pred[] should be root for root, -1 for unrechable vertices
 //prior to calling run_bfs pred is set to -1 by calling clean_pred
 void run_bfs(int64_t root, int64_t* pred) {
+	int64_t nvisited=1,sum[NEXT_LAST];
+	int64_t edges_unexplored=nglobaledges_csr,edges_frontier=0,prev_frontier=0;
+	int bottomup=0;
 	pred_glob=pred;
-	//user code to do bfs
+	aml_register_handler(visithndl,1);
+
+	CLEAN_VISITED();
+
+	qc=0; sum[NEXT_N]=1;
+	nextlvl[NEXT_N]=0; nextlvl[NEXT_M]=0;
+
+	if(VERTEX_OWNER(root) == rank) {
+		pred[VERTEX_LOCAL(root)]=root;
+		SET_VISITED(root);
+		q1[0]=VERTEX_LOCAL(root);
+		qc=1;
+	}
+	tepsedges = VERTEX_OWNER(root) == rank ? INPUT_DEGREE(g,VERTEX_LOCAL(root)) : 0;
+
+	// While there are vertices in current level
+	while(sum[NEXT_N]) {
+#ifdef DEBUGSTATS
+		double t0=aml_time();
+		nbytes_sent=0; nbytes_rcvd=0;
+#endif
+		//alpha/beta heuristic with global frontier size and edges of previous level
+		if(!bottomup && edges_frontier > edges_unexplored/BFS_ALPHA && sum[NEXT_N] > prev_frontier)
+			bottomup=1;
+		else if(bottomup && sum[NEXT_N] < g.nglobalverts/BFS_BETA && sum[NEXT_N] < prev_frontier)
+			bottomup=0;
+		prev_frontier=sum[NEXT_N];
+
+		if(bottomup)
+			bottom_up_step();
+		else
+			top_down_step();
+		aml_barrier_allreduce(nextlvl,sum,NEXT_LAST,AML_SUM);
+
+		qc=nextlvl[NEXT_N];int *tmp=q1;q1=q2;q2=tmp;
+		tepsedges+=nextlvl[NEXT_M];
+		nextlvl[NEXT_N]=0; nextlvl[NEXT_M]=0;
+		edges_frontier=sum[NEXT_M];
+		edges_unexplored-=edges_frontier;
+		nvisited+=sum[NEXT_N];
+#ifdef DEBUGSTATS
+		aml_long_allsum(&nbytes_sent);
+		t0-=aml_time();
+		if(!my_pe()) printf (" --lvl %s: %lld(%lld,%3.2f) visited in %5.2fs, network aggr %5.2fGb/s\n",bottomup?"BU":"TD",sum[NEXT_N],nvisited,((double)nvisited/(double)g.notisolated)*100.0,-t0,-(double)nbytes_sent*8.0/(1.e9*t0));
+#endif
+	}
+	aml_barrier();
 }
 
 //we need edge count to calculate teps. Validation will check if this count is correct
 //user should change this function if another format (not standart CRS) used
+//there are no self-loops in CSR, so edges of reached component are half of sum of degrees counted during traversal
 void get_edge_count_for_teps(int64_t* edge_visit_count) {
-	long i,j;
-	long edge_count=0;
-	for(i=0;i<g.nlocalverts;i++)
-		if(pred_glob[i]!=-1) {
-			for(j=g.rowstarts[i];j<g.rowstarts[i+1];j++)
-				if(COLUMN(j)<=VERTEX_TO_GLOBAL(my_pe(),i))
-					edge_count++;
-		}
+	long edge_count=tepsedges;
 	aml_long_allsum(&edge_count);
-	*edge_visit_count=edge_count;
+	*edge_visit_count=edge_count/2;
 }
 
 //user provided function to initialize predecessor array to whatevere value user needs
@@ -64,7 +224,11 @@ void clean_pred(int64_t* pred) {
 //user provided function to be called once graph is no longer needed
 void free_graph_data_structure(void) {
 	free_oned_csr_graph(&g);
-	free(visited);
+	free(q1); free(q2); free(visited);
+	free(frontier); free(frontier_glob);
+#ifdef SSSP
+	free_sssp_data_structure();
+#endif
 }
 
 //user should change is function if distribution(and counts) of vertices is changed
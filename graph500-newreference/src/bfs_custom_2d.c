@@ -0,0 +1,171 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Graph500: Kernel 2: BFS
+// Level-synchronized BFS on 2D edge distribution (see csr_2d.h):
+// expand sends frontier to pes of owners grid column, fold sends visits to pes of owners grid row
+
+#include "common.h"
+#include "aml.h"
+#include "csr_2d.h"
+#include "bitmap_reference.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef DEBUGSTATS
+extern int64_t nbytes_sent,nbytes_rcvd;
+#endif
+// two arrays holding visited VERTEX_LOCALs for current and next level
+int *q1,*q2;
+int64_t qc,q2c;
+// sources of local edges (SRC_LOCAL) in current level received by expand
+int *srcq;
+int64_t srcqc;
+// sources which were in any frontier, for edge count
+unsigned long *srcvisited;
+int64_t srcvisited_size;
+
+//VISITED bitmap parameters
+unsigned long *visited;
+int64_t visited_size;
+
+//global variables of CSR graph to be used inside of AM-handlers
+int64_t *pred_glob,*column;
+unsigned int *rowstarts;
+twod_csr_graph g;
+
+typedef struct visitmsg {
+	int vloc; //VERTEX_LOCAL of visited vertex
+	int uloc; //SRC_LOCAL of parent, its grid column is the one of sender
+} visitmsg;
+
+//AM-handler for expand: frontier vertex of my grid column
+void expandhndl(int from,void* data,int sz) {
+	int uloc = *(int*)data;
+	srcq[srcqc++] = uloc;
+	srcvisited[uloc ulong_shift] |= 1UL << (uloc ulong_mask);
+}
+
+//AM-handler for fold: check&visit
+void visithndl(int from,void* data,int sz) {
+	visitmsg *m = data;
+	if (!TEST_VISITEDLOC(m->vloc)) {
+		SET_VISITEDLOC(m->vloc);
+		q2[q2c++] = m->vloc;
+		pred_glob[m->vloc] = SRC_TO_GLOBAL(from % grid_cols,m->uloc);
+	}
+}
+
+void make_graph_data_structure(const tuple_graph* const tg) {
+	int i;
+	convert_graph_to_twod_csr(tg, &g);
+	column=g.column;
+	rowstarts=g.rowstarts;
+
+	visited_size = (g.nlocalverts + ulong_bits - 1) / ulong_bits;
+	visited = xmalloc(visited_size*sizeof(unsigned long));
+	srcvisited_size = (g.nlocalsrc + ulong_bits - 1) / ulong_bits;
+	srcvisited = xmalloc(srcvisited_size*sizeof(unsigned long));
+	q1 = xmalloc(g.nlocalverts*sizeof(int)); //100% of vertexes
+	q2 = xmalloc(g.nlocalverts*sizeof(int));
+	srcq = xmalloc(g.nlocalsrc*sizeof(int));
+	for(i=0;i<g.nlocalverts;i++) q1[i]=0,q2[i]=0; //touch memory
+	for(i=0;i<g.nlocalsrc;i++) srcq[i]=0;
+}
+
+void run_bfs(int64_t root, int64_t* pred) {
+	int64_t nvisited=1,sum=1;
+	unsigned int i,r;
+	size_t j,end;
+	pred_glob=pred;
+	aml_register_handler(expandhndl,1);
+	aml_register_handler(visithndl,2);
+
+	CLEAN_VISITED();
+	memset(srcvisited,0,srcvisited_size*sizeof(unsigned long));
+
+	qc=0; q2c=0;
+	if(VERTEX_OWNER(root) == rank) {
+		pred[VERTEX_LOCAL(root)]=root;
+		SET_VISITED(root);
+		q1[0]=VERTEX_LOCAL(root);
+		qc=1;
+	}
+
+	// While there are vertices in current level
+	while(sum) {
+#ifdef DEBUGSTATS
+		double t0=aml_time();
+		nbytes_sent=0; nbytes_rcvd=0;
+#endif
+		//expand: my frontier to all pes of my grid column
+		srcqc=0;
+		for(i=0;i<qc;i++) {
+			int uloc = SRC_LOCAL(VERTEX_TO_GLOBAL(rank,q1[i]));
+			for(r=0;r<grid_rows;r++)
+				aml_send(&uloc,1,sizeof(int),GRID_PE(r,grid_mycol));
+		}
+		aml_barrier();
+
+		//fold: visit targets of local edges, their owners are in my grid row
+		for(i=0;i<srcqc;i++)
+			for(j=ROWSTART(g,srcq[i]),end=ROWEND(g,srcq[i]);j<end;j++) {
+				int64_t v = COLUMN(j);
+				visitmsg m = {VERTEX_LOCAL(v),srcq[i]};
+				aml_send(&m,2,sizeof(visitmsg),VERTEX_OWNER(v));
+			}
+		aml_barrier_allreduce(&q2c,&sum,1,AML_SUM);
+
+		qc=q2c;int *tmp=q1;q1=q2;q2=tmp;
+		q2c=0;
+		nvisited+=sum;
+#ifdef DEBUGSTATS
+		aml_long_allsum(&nbytes_sent);
+		t0-=aml_time();
+		if(!my_pe()) printf (" --lvl : %lld(%lld) visited in %5.2fs, network aggr %5.2fGb/s\n",sum,nvisited,-t0,-(double)nbytes_sent*8.0/(1.e9*t0));
+#endif
+	}
+	aml_barrier();
+}
+
+//we need edge count to calculate teps. Validation will check if this count is correct
+//each directed copy of an edge is stored once, counted at the pe having it if its source was reached
+void get_edge_count_for_teps(int64_t* edge_visit_count) {
+	long i,j;
+	long edge_count=0;
+	for(i=0;i<g.nlocalsrc;i++)
+		if(srcvisited[i ulong_shift] & (1UL << (i ulong_mask))) {
+			for(j=ROWSTART(g,i);j<ROWEND(g,i);j++)
+				if(COLUMN(j)<=SRC_TO_GLOBAL(grid_mycol,i))
+					edge_count++;
+		}
+	aml_long_allsum(&edge_count);
+	*edge_visit_count=edge_count;
+}
+
+void clean_pred(int64_t* pred) {
+	int i;
+	for(i=0;i<g.nlocalverts;i++) pred[i]=-1;
+}
+
+void free_graph_data_structure(void) {
+	free_twod_csr_graph(&g);
+	free(q1); free(q2); free(srcq); free(visited); free(srcvisited);
+}
+
+size_t get_nlocalverts_for_pred(void) {
+	return g.nlocalverts;
+}
@@ -14,6 +14,8 @@
 #include "aml.h"
 #include "csr_reference.h"
 #include "bitmap_reference.h"
+#include "hub_reference.h"
+#include "trace.h"
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -29,126 +31,441 @@ extern int64_t nbytes_sent,nbytes_rcvd;
 // two arrays holding visited VERTEX_LOCALs for current and next level
 // we swap pointers each time
 int *q1,*q2;
-int qc,q2c; //pointer to first free element
+int64_t qc,q2c; //pointer to first free element
+enum { NEXT_N, NEXT_M, NEXT_LAST };
+int64_t nextlvl[NEXT_LAST]; //vertices in next level and sum of their degrees, updated by handler
+//degree sum of vertices reached by this pe in last BFS or SSSP, each traversed edge is in it twice
+int64_t tepsedges;
+
+//level with many vertices is kept as bitmap instead of queue, fr1/fr2 are swapped as q1/q2.
+//bitmap is used for next level if edges of current one (bound of its size) reach nlocalverts/FRONTIER_DENSE_DIV
+//on average over pes (both sides averaged), then expansion scans words in vertex order and no thread queues are merged
+#ifndef FRONTIER_DENSE_DIV
+#define FRONTIER_DENSE_DIV 64
+#endif
+unsigned long *fr1,*fr2;
+int dense1,dense2; //current and next level are bitmaps
+#ifdef _OPENMP
+#define SET_FRONTIERLOC(f,v) __sync_fetch_and_or(&f[(v) ulong_shift], 1UL << ((v) ulong_mask))
+#else
+#define SET_FRONTIERLOC(f,v) do {f[(v) ulong_shift] |= (1UL << ((v) ulong_mask));} while (0)
+#endif
 
 //VISITED bitmap parameters
 unsigned long *visited;
 int64_t visited_size;
 
+//sender-side filter of vertices already targeted by visits from this pe (in this or earlier levels)
+//exact bitmap of all global vertices if it fits into SENT_FILTER_BYTES, otherwise direct-mapped cache
+#ifndef SENT_FILTER_BYTES
+#define SENT_FILTER_BYTES (1UL<<26)
+#endif
+unsigned long *sent;
+int64_t *sent_cache,sent_words;
+uint64_t sent_mask;
+#ifdef _OPENMP
+#define TEST_AND_SET_SENT(v) ((sent[(v) ulong_shift] & (1UL << ((v) ulong_mask))) != 0 || (__sync_fetch_and_or(&sent[(v) ulong_shift], 1UL << ((v) ulong_mask)) & (1UL << ((v) ulong_mask))) != 0)
+#else
+#define TEST_AND_SET_SENT(v) ((sent[(v) ulong_shift] & (1UL << ((v) ulong_mask))) != 0 ? 1 : (sent[(v) ulong_shift] |= (1UL << ((v) ulong_mask)), 0))
+#endif
+
 //global variables of CSR graph to be used inside of AM-handlers
 int64_t *column;
 int64_t *pred_glob;
 unsigned int * rowstarts;
+int64_t * rowbase;
 
 oned_csr_graph g;
 
+//hub delegation, see hub_reference.h
+hub_graph hubs;
+unsigned long *hubvisited,*hubfront,*hubnext; //replicated bitmaps by hub index
+int64_t *hubpred; //parent candidate of hub marked by this pe, minimum over pes is taken
+#ifdef SSSP
+//in sssp_reference.c
+void make_sssp_data_structure(void);
+void free_sssp_data_structure(void);
+#endif
+#ifdef RELABEL_CSR
+int64_t *pred_relabeled; //pred indexed by relabeled VERTEX_LOCAL, copied to user pred after BFS
+#endif
+#define TEST_HUB(b,k) ((b[(k) ulong_shift] & (1UL << ((k) ulong_mask))) != 0)
+
 typedef struct visitmsg {
 	//both vertexes are VERTEX_LOCAL components as we know src and dest PEs to reconstruct VERTEX_GLOBAL
 	int vloc;
 	int vfrom;
 } visitmsg;
 
-//AM-handler for check&visit
+//frontier expansion is done by OpenMP threads (if enabled), AML is called by one thread at a time.
+//each thread stages visits per destination pe and sends them as one AM of up to VISIT_BATCH visits,
+//vertices it visits go to its own queue, queues are merged into q2 after the level
+#ifdef _OPENMP
+#include <omp.h>
+#define THREAD_ID omp_get_thread_num()
+#else
+#define THREAD_ID 0
+#endif
+#define VISIT_BATCH 64
+
+typedef struct bfs_thread {
+	int *q; //next level vertices found by this thread, for thread 0 it is q2 itself
+	int64_t qc,qcap;
+	int64_t nvisited; //visited locally (not by handler) during expansion
+	int64_t ndeg; //sum of their degrees
+	int64_t nscan; //edges scanned in current level, for trace
+	visitmsg *stage; //VISIT_BATCH visits for each pe
+	int *stagec;
+} __attribute__((aligned(64))) bfs_thread;
+
+bfs_thread *threads;
+int nthreads;
+
+static inline void push_thread_queue(bfs_thread *t, int vloc) {
+	if(t->qc==t->qcap) {
+		t->qcap*=2;
+		t->q = realloc(t->q,t->qcap*sizeof(int));
+		assert(t->q != NULL);
+	}
+	t->q[t->qc++] = vloc;
+}
+
+static inline void add_next(bfs_thread *t, int vloc) {
+	if(dense2)
+		SET_FRONTIERLOC(fr2,vloc);
+	else
+		push_thread_queue(t,vloc);
+}
+
+//AM-handler for check&visit of a batch of visits, AML calls are serialized so nextlvl needs no atomics
 void visithndl(int from,void* data,int sz) {
 	visitmsg *m = data;
-	if (!TEST_VISITEDLOC(m->vloc)) {
-		SET_VISITEDLOC(m->vloc);
-		q2[q2c++] = m->vloc;
-		pred_glob[m->vloc] = VERTEX_TO_GLOBAL(from,m->vfrom);
+	bfs_thread *t = &threads[THREAD_ID];
+	int i;
+	for(i=0;i<sz/sizeof(visitmsg);i++)
+		if (!TEST_AND_SET_VISITEDLOC(m[i].vloc)) {
+			pred_glob[m[i].vloc] = VERTEX_TO_GLOBAL(from,m[i].vfrom);
+			add_next(t,m[i].vloc);
+			nextlvl[NEXT_N]++;
+			nextlvl[NEXT_M]+=INPUT_DEGREE(g,m[i].vloc);
+		}
+}
+
+static inline void visit_local(bfs_thread *t, int vloc, int64_t parent) {
+	if(!TEST_AND_SET_VISITEDLOC(vloc)) {
+		pred_glob[vloc] = parent;
+		add_next(t,vloc);
+		t->nvisited++;
+		t->ndeg+=INPUT_DEGREE(g,vloc);
+	}
+}
+
+//visit of hub is only marked in hubnext, returns 0 if glob is not a hub
+static inline int mark_hub(int64_t glob, int64_t parent) {
+	int h = hub_index(&hubs,glob);
+	if(h < 0) return 0;
+	if(!TEST_HUB(hubvisited,h)) {
+		hubpred[h] = parent;
+		SET_FRONTIERLOC(hubnext,h);
 	}
+	return 1;
+}
+
+static void send_stage(bfs_thread *t, int pe) {
+#ifdef _OPENMP
+#pragma omp critical(aml)
+#endif
+	aml_send(t->stage+pe*VISIT_BATCH,1,t->stagec[pe]*sizeof(visitmsg),pe);
+	t->stagec[pe]=0;
 }
 
-inline void send_visit(int64_t glob, int from) {
-	visitmsg m = {VERTEX_LOCAL(glob),from};
-	aml_send(&m,1,sizeof(visitmsg),VERTEX_OWNER(glob));
+static inline void send_visit(int64_t glob, int from, bfs_thread *t) {
+	int pe = VERTEX_OWNER(glob);
+	//hubs are looked up only for targets not known to be visited
+	if(pe == rank) { //own vertex, no need for a message
+		if(TEST_VISITEDLOC(VERTEX_LOCAL(glob)) || mark_hub(glob,VERTEX_TO_GLOBAL(rank,ORIGINAL_LOCAL(g,from)))) return;
+		visit_local(t,VERTEX_LOCAL(glob),VERTEX_TO_GLOBAL(rank,ORIGINAL_LOCAL(g,from)));
+		return;
+	}
+	//visit was sent before so vertex is visited or will be when level ends
+	if(sent) {
+		if(TEST_AND_SET_SENT(glob)) return;
+	} else {
+		if(sent_cache[glob & sent_mask] == glob) return;
+		sent_cache[glob & sent_mask] = glob;
+	}
+	if(mark_hub(glob,VERTEX_TO_GLOBAL(rank,ORIGINAL_LOCAL(g,from)))) return;
+	visitmsg *m = t->stage+pe*VISIT_BATCH+t->stagec[pe]++;
+	m->vloc = VERTEX_LOCAL(glob);
+	m->vfrom = ORIGINAL_LOCAL(g,from);
+	if(t->stagec[pe] == VISIT_BATCH) send_stage(t,pe);
 }
 
 void make_graph_data_structure(const tuple_graph* const tg) {
 	int i,j,k;
 	convert_graph_to_oned_csr(tg, &g);
+#ifdef RELABEL_CSR
+	relabel_oned_csr(&g);
+	pred_relabeled = xmalloc(g.nlocalverts*sizeof(int64_t));
+#endif
 	column=g.column;
 	rowstarts=g.rowstarts;
+	rowbase=g.rowbase;
 
 	visited_size = (g.nlocalverts + ulong_bits - 1) / ulong_bits;
 	aml_register_handler(visithndl,1);
 	q1 = xmalloc(g.nlocalverts*sizeof(int)); //100% of vertexes
 	q2 = xmalloc(g.nlocalverts*sizeof(int));
-	for(i=0;i<g.nlocalverts;i++) q1[i]=0,q2[i]=0; //touch memory
 	visited = xmalloc(visited_size*sizeof(unsigned long));
+	fr1 = xmalloc(visited_size*sizeof(unsigned long));
+	fr2 = xmalloc(visited_size*sizeof(unsigned long));
+	//touch memory: with OpenMP pages are first touched by a static partition of threads,
+	//spreading them over NUMA nodes of the threads expanding levels
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for(i=0;i<g.nlocalverts;i++) q1[i]=0,q2[i]=0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for(i=0;i<visited_size;i++) visited[i]=0,fr1[i]=0,fr2[i]=0;
+
+	sent = NULL; sent_cache = NULL;
+	sent_words = (g.nglobalverts + ulong_bits - 1) / ulong_bits;
+	if(sent_words*sizeof(unsigned long) <= SENT_FILTER_BYTES)
+		sent = xmalloc(sent_words*sizeof(unsigned long));
+	else {
+		sent_mask = SENT_FILTER_BYTES/sizeof(int64_t) - 1;
+		sent_cache = xmalloc(SENT_FILTER_BYTES);
+	}
+
+#ifdef _OPENMP
+	nthreads = omp_get_max_threads();
+#else
+	nthreads = 1;
+#endif
+	threads = xmalloc(nthreads*sizeof(bfs_thread));
+	for(i=0;i<nthreads;i++) {
+		threads[i].qcap = 1024;
+		threads[i].q = i ? xmalloc(threads[i].qcap*sizeof(int)) : NULL;
+		threads[i].stage = xmalloc(num_pes()*VISIT_BATCH*sizeof(visitmsg));
+		threads[i].stagec = xcalloc(num_pes(),sizeof(int));
+	}
+
+	make_hub_graph(&g,&hubs);
+#ifdef SSSP
+	make_sssp_data_structure();
+#endif
+	hubvisited = xcalloc(hubs.words+1,sizeof(unsigned long));
+	hubfront = xcalloc(hubs.words+1,sizeof(unsigned long));
+	hubnext = xcalloc(hubs.words+1,sizeof(unsigned long));
+	hubpred = xmalloc((hubs.nhubs+1)*sizeof(int64_t));
 }
 
+//expand one vertex of current level from thread th
+#define EXPAND(th,u) do { row_iter it; int64_t v; th->nscan+=rowstarts[(u)+1]-rowstarts[u]; for(row_begin(&it,&g,u);row_next(&it,&v);) send_visit(v,u,th); } while (0)
+
 void run_bfs(int64_t root, int64_t* pred) {
 	int64_t nvisited;
-	long sum;
-	unsigned int i,j,k,lvl=1;
+	int64_t sum[NEXT_LAST];
+	int64_t i,j,t;
+	int64_t hubsown=0; //hubs of next level owned by this pe, for trace
+	unsigned int lvl=1;
+#ifdef RELABEL_CSR
+	int64_t *pred_user=pred;
+	pred=pred_relabeled;
+	for(i=0;i<g.nlocalverts;i++) pred[i]=-1;
+#endif
 	pred_glob=pred;
 	aml_register_handler(visithndl,1);
+	trace_begin("bfs",root);
 
 	CLEAN_VISITED();
+	if(sent)
+		memset(sent,0,sent_words*sizeof(unsigned long));
+	else
+		memset(sent_cache,-1,SENT_FILTER_BYTES);
 
-	qc=0; sum=1; q2c=0;
+	qc=0; sum[NEXT_N]=1; sum[NEXT_M]=0;
+	nextlvl[NEXT_N]=0; nextlvl[NEXT_M]=0;
+	dense1=0;
+	memset(hubvisited,0,hubs.words*sizeof(unsigned long));
+	memset(hubfront,0,hubs.words*sizeof(unsigned long));
+	memset(hubnext,0,hubs.words*sizeof(unsigned long));
+	for(i=0;i<hubs.nhubs;i++) hubpred[i]=INT64_MAX;
+	for(i=0;i<hubs.nhubs;i++)
+		if(hubs.parents[i]==root) hubvisited[i ulong_shift] |= 1UL << (i ulong_mask); //expanded by owner as usual
 
 	nvisited=1;
+	tepsedges=0;
 	if(VERTEX_OWNER(root) == rank) {
-		pred[VERTEX_LOCAL(root)]=root;
-		SET_VISITED(root);
-		q1[0]=VERTEX_LOCAL(root);
+		int rloc=RELABELED_LOCAL(g,VERTEX_LOCAL(root));
+		pred[rloc]=root;
+		SET_VISITEDLOC(rloc);
+		q1[0]=rloc;
 		qc=1;
-	} 
+		tepsedges=INPUT_DEGREE(g,rloc);
+	}
 
 	// While there are vertices in current level
-	while(sum) {
+	while(sum[NEXT_N]) {
 #ifdef DEBUGSTATS
 		double t0=aml_time();
 		nbytes_sent=0; nbytes_rcvd=0;
 #endif
+		trace_level_begin();
+		//same choice on all pes (nlocalverts differs by one between them, so average share is
+		//compared): edges of current level bound size of next one
+		dense2 = sum[NEXT_M]/num_pes() >= g.nglobalverts/num_pes()/FRONTIER_DENSE_DIV;
+		//thread 0 fills q2 directly, it can not overflow
+		threads[0].q=q2; threads[0].qcap=g.nlocalverts;
+		for(t=0;t<nthreads;t++) threads[t].qc=0,threads[t].nvisited=0,threads[t].ndeg=0,threads[t].nscan=0;
+
 		//for all vertices in current level send visit AMs to all neighbours
-		for(i=0;i<qc;i++)
-			for(j=rowstarts[q1[i]];j<rowstarts[q1[i]+1];j++)
-				send_visit(COLUMN(j),q1[i]);
-		aml_barrier();
+#ifdef _OPENMP
+#pragma omp parallel private(i,j)
+#endif
+		{
+			bfs_thread *th = &threads[THREAD_ID];
+			int pe;
+			if(dense1) {
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+				for(i=0;i<visited_size;i++) {
+					unsigned long w=fr1[i];
+					while(w) {
+						int u = i*ulong_bits + __builtin_ctzl(w);
+						w &= w-1;
+						EXPAND(th,u);
+					}
+				}
+			} else {
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+				for(i=0;i<qc;i++)
+					EXPAND(th,q1[i]);
+			}
+			//delegated edges of hubs in current level, targets are local
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,1)
+#endif
+			for(i=0;i<hubs.nhubs;i++)
+				if(TEST_HUB(hubfront,i)) {
+					th->nscan+=hubs.rowstarts[i+1]-hubs.rowstarts[i];
+					for(j=ROWSTART(hubs,i);j<ROWEND(hubs,i);j++)
+						if(!TEST_VISITEDLOC(hubs.column[j]) && !mark_hub(VERTEX_TO_GLOBAL(rank,hubs.column[j]),hubs.parents[i]))
+							visit_local(th,hubs.column[j],hubs.parents[i]);
+				}
+			for(pe=0;pe<num_pes();pe++)
+				if(th->stagec[pe]) send_stage(th,pe);
+		}
+		for(t=0;t<nthreads;t++) nextlvl[NEXT_N]+=threads[t].nvisited,nextlvl[NEXT_M]+=threads[t].ndeg;
+		//deliver visits and sum up next level size in one round
+		trace_phase(TRACE_BARRIER);
+		aml_barrier_allreduce(nextlvl,sum,NEXT_LAST,AML_SUM);
+		trace_phase(TRACE_ALLREDUCE);
+
+		int64_t nfront=qc+hubsown,nscan=0;
+		for(t=0;t<nthreads;t++) nscan+=threads[t].nscan;
+		hubsown=0;
+		if(hubs.nhubs) {
+			//hubs marked by any pe are next level on all pes, owner records them
+			int64_t nhubsnew=0;
+			MPI_Allreduce(MPI_IN_PLACE,hubnext,hubs.words,MPI_UNSIGNED_LONG,MPI_BOR,MPI_COMM_WORLD);
+			for(i=0;i<hubs.words;i++) {
+				hubfront[i]=hubnext[i]&~hubvisited[i];
+				hubvisited[i]|=hubfront[i];
+				hubnext[i]=0;
+				nhubsnew+=__builtin_popcountl(hubfront[i]);
+			}
+			if(nhubsnew) {
+				MPI_Allreduce(MPI_IN_PLACE,hubpred,hubs.nhubs,MPI_INT64_T,MPI_MIN,MPI_COMM_WORLD);
+				for(i=0;i<hubs.nhubs;i++)
+					if(TEST_HUB(hubfront,i)) {
+						sum[NEXT_N]++;
+						sum[NEXT_M]+=hubs.degrees[i];
+						if(VERTEX_OWNER(hubs.ids[i]) == rank) {
+							SET_VISITED(hubs.ids[i]);
+							pred[VERTEX_LOCAL(hubs.ids[i])]=hubpred[i];
+							tepsedges+=hubs.degrees[i];
+							hubsown++;
+						}
+					}
+			}
+		}
+
+		trace_phase(TRACE_EXPAND);
+
+		if(!dense2) {
+			//merge thread queues behind the part thread 0 wrote to q2
+			threads[0].nvisited=0; //reused as offset
+			for(t=1;t<nthreads;t++) threads[t].nvisited=threads[t-1].nvisited+threads[t-1].qc;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+			for(t=1;t<nthreads;t++)
+				memcpy(q2+threads[t].nvisited,threads[t].q,threads[t].qc*sizeof(int));
+		}
+		//bitmap of finished level is target of level after next one
+		if(dense1) memset(fr1,0,visited_size*sizeof(unsigned long));
 
-		qc=q2c;int *tmp=q1;q1=q2;q2=tmp;
-		sum=qc;
-		aml_long_allsum(&sum);
+		qc=nextlvl[NEXT_N];int *tmp=q1;q1=q2;q2=tmp;
+		unsigned long *ftmp=fr1;fr1=fr2;fr2=ftmp;
+		dense1=dense2;
 
-		nvisited+=sum;
+		nvisited+=sum[NEXT_N];
+		tepsedges+=nextlvl[NEXT_M];
 
-		q2c=0;
+		nextlvl[NEXT_N]=0; nextlvl[NEXT_M]=0;
+		trace_level_end(nfront,nscan);
 #ifdef DEBUGSTATS
 		aml_long_allsum(&nbytes_sent);
 		t0-=aml_time();
-		if(!my_pe()) printf (" --lvl%d : %lld(%lld,%3.2f) visited in %5.2fs, network aggr %5.2fGb/s\n",lvl++,sum,nvisited,((double)nvisited/(double)g.notisolated)*100.0,-t0,-(double)nbytes_sent*8.0/(1.e9*t0));
+		if(!my_pe()) printf (" --lvl%d %s: %lld(%lld,%3.2f) visited in %5.2fs, network aggr %5.2fGb/s\n",lvl++,dense1?"bitmap":"queue",sum[NEXT_N],nvisited,((double)nvisited/(double)g.notisolated)*100.0,-t0,-(double)nbytes_sent*8.0/(1.e9*t0));
 #endif
 	}
 	aml_barrier();
+#ifdef RELABEL_CSR
+	for(i=0;i<g.nlocalverts;i++) pred_user[i]=pred[RELABELED_LOCAL(g,i)];
+#endif
 
 }
 
 //we need edge count to calculate teps. Validation will check if this count is correct
+//there are no self-loops in CSR, so edges of reached component are half of sum of degrees counted during traversal
 void get_edge_count_for_teps(int64_t* edge_visit_count) {
-	long i,j;
-	long edge_count=0;
-	for(i=0;i<g.nlocalverts;i++)
-		if(pred_glob[i]!=-1) {
-			for(j=rowstarts[i];j<rowstarts[i+1];j++)
-				if(COLUMN(j)<=VERTEX_TO_GLOBAL(my_pe(),i))
-					edge_count++;
-
-		}
-
+	long edge_count=tepsedges;
 	aml_long_allsum(&edge_count);
-	*edge_visit_count=edge_count;
+	*edge_visit_count=edge_count/2;
 }
 
 void clean_pred(int64_t* pred) {
 	int i;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for(i=0;i<g.nlocalverts;i++) pred[i]=-1;
 }
 void free_graph_data_structure(void) {
 	int i; 
 	free_oned_csr_graph(&g);
-	free(q1); free(q2); free(visited);
+	free(q1); free(q2); free(visited); free(fr1); free(fr2);
+	free(sent); free(sent_cache);
+	for(i=0;i<nthreads;i++) {
+		if(i) free(threads[i].q);
+		free(threads[i].stage); free(threads[i].stagec);
+	}
+	free(threads);
+	free_hub_graph(&hubs);
+#ifdef SSSP
+	free_sssp_data_structure();
+#endif
+	free(hubvisited); free(hubfront); free(hubnext); free(hubpred);
+#ifdef RELABEL_CSR
+	free(pred_relabeled);
+#endif
 }
 
 size_t get_nlocalverts_for_pred(void) {
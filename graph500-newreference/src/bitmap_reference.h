@@ -14,5 +14,12 @@
 #define SET_VISITED(v) do {visited[VERTEX_LOCAL((v)) ulong_shift] |= (1UL << (VERTEX_LOCAL((v)) ulong_mask));} while (0)
 #define SET_VISITEDLOC(v) do {visited[(v) ulong_shift] |= (1ULL << ((v) ulong_mask));} while (0)
 #define TEST_VISITED(v) ((visited[VERTEX_LOCAL((v)) ulong_shift] & (1UL << (VERTEX_LOCAL((v)) ulong_mask))) != 0)
+#define CLEAR_VISITEDLOC(v) do {visited[(v) ulong_shift] &= ~(1ULL << ((v) ulong_mask));} while (0)
 #define TEST_VISITEDLOC(v) ((visited[(v) ulong_shift] & (1ULL << ((v) ulong_mask))) != 0)
 #define CLEAN_VISITED()  memset(visited,0,visited_size*sizeof(unsigned long));
+//returns if bit was set before and sets it, atomic if threads are used
+#ifdef _OPENMP
+#define TEST_AND_SET_VISITEDLOC(v) (TEST_VISITEDLOC(v) || (__sync_fetch_and_or(&visited[(v) ulong_shift], 1UL << ((v) ulong_mask)) & (1UL << ((v) ulong_mask))) != 0)
+#else
+#define TEST_AND_SET_VISITEDLOC(v) (TEST_VISITEDLOC(v) ? 1 : (visited[(v) ulong_shift] |= (1UL << ((v) ulong_mask)), 0))
+#endif
@@ -51,12 +51,31 @@ typedef struct tuple_graph {
 	int64_t max_edgememory_size;
 	MPI_File edgefile; /* Or MPI_FILE_NULL if edges are in memory */
 	int64_t nglobaledges; /* Number of edges in graph, in both cases */
+	int scale, edgefactor; /* Parameters and seeds the graph was generated with, */
+	uint64_t seed1, seed2; /* identify CSR snapshots */
 #ifdef SSSP
 	float* restrict weightmemory;
 	MPI_File weightfile;
 #endif
 } tuple_graph;
 
+/* Edge weights stored in CSR. With COMPACT_WEIGHTS generator weights in [0,1) are
+ * kept as 16-bit fixed point, rounded to nearest multiple of 1/WEIGHT_SCALE (1.0 is
+ * representable, no clamping), so each weight is off by at most half of WEIGHT_ERROR,
+ * other half is left for float rounding of distances.
+ * Distances are accumulated and reported as float in both cases. */
+#ifdef COMPACT_WEIGHTS
+typedef uint16_t weight_t;
+#define WEIGHT_SCALE 65535.0f
+#define WEIGHT_FROM_FLOAT(f) ((weight_t)(int)((f)*WEIGHT_SCALE+0.5f))
+#define WEIGHT_TO_FLOAT(w) ((float)(w)*(1.0f/WEIGHT_SCALE))
+#define WEIGHT_ERROR (1.0f/WEIGHT_SCALE)
+#else
+typedef float weight_t;
+#define WEIGHT_FROM_FLOAT(f) (f)
+#define WEIGHT_TO_FLOAT(w) (w)
+#endif
+
 #define FILE_CHUNKSIZE ((MPI_Offset)(1) << 23) /* Size of one file I/O block or memory block to be processed in one step, in edges */
 
 /* Simple iteration of edge data or file; cannot be nested. */
@@ -211,6 +230,18 @@ typedef struct tuple_graph {
 						return FILE_CHUNKSIZE;
 					}
 
+// Row offsets are kept in two levels so that a pe can hold 2^32 edges and more: rowstarts has
+// the low 32 bits of offset of each row and rowbase the full offset of every 1<<ROW_BLOCK_SHIFT-th
+// row. Offset of a row is base of its block plus distance to it modulo 2^32, which is exact while
+// a block has less than 2^32 edges (checked by make_rowstarts). Degrees are still
+// rowstarts[i+1]-rowstarts[i] in unsigned arithmetic. Costs 4 bytes per row as before.
+#ifndef ROW_BLOCK_SHIFT
+#define ROW_BLOCK_SHIFT 16
+#endif
+#define ROW_OFFSET(rowstarts,rowbase,i) ((size_t)(rowbase)[(i)>>ROW_BLOCK_SHIFT] + (unsigned int)((rowstarts)[i] - (unsigned int)(rowbase)[(i)>>ROW_BLOCK_SHIFT]))
+#define ROWSTART(g,i) ROW_OFFSET((g).rowstarts,(g).rowbase,i)
+#define ROWEND(g,i) (ROWSTART(g,i) + (unsigned int)((g).rowstarts[(i)+1] - (g).rowstarts[i]))
+
 #ifdef __cplusplus
 					extern "C" {
 #endif
@@ -221,8 +252,12 @@ typedef struct tuple_graph {
 						void* xMPI_Alloc_mem(size_t nbytes); /* In utils.c */
 						void* xmalloc(size_t nbytes); /* In utils.c */
 						void* xcalloc(size_t n, size_t unit); /* In utils.c */
+						size_t make_rowstarts(const int* degrees, size_t nrows, unsigned int** rowstarts, int64_t** rowbase); /* In utils.c */
 
 						int validate_result(int isbfs, const tuple_graph* const tg, const size_t nlocalverts, const int64_t root, int64_t* const pred, float * dist, int64_t* const edge_visit_count_ptr); /* In validate.c */
+#ifdef COMPACT_WEIGHTS
+						extern float validate_weight_error; /* In validate.c: largest deviation from exact SSSP conditions accepted so far */
+#endif
 
 						/* Definitions in each BFS file, using static global variables for internal
 						 * storage: */
@@ -232,6 +267,12 @@ typedef struct tuple_graph {
 						void get_edge_count_for_teps(int64_t* edge_visit_count);
 						void clean_pred(int64_t* pred);
 						size_t get_nlocalverts_for_pred(void);
+						/* Definitions in multi-source BFS file (bfs_batch.c) for batched mode */
+#ifdef BATCHED_BFS
+						int run_bfs_batch(int nroots, const int64_t* roots);
+						void get_bfs_batch_pred(int idx, int64_t* pred);
+						void free_bfs_batch(void);
+#endif
 						/* Definitions in SSSP file in case this kernel is implemented */
 #ifdef SSSP
 						void run_sssp(int64_t root, int64_t* pred, float * dist_shortest);
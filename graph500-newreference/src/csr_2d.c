@@ -0,0 +1,160 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Graph500: Kernel 1: CRS construction for 2D edge distribution
+// Same two-pass scheme as csr_reference.c, edges are sent to EDGE_PE instead of VERTEX_OWNER
+
+#include "common.h"
+#include "csr_2d.h"
+#include "bitmap_reference.h"
+#include "aml.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+int grid_rows,grid_cols,grid_myrow,grid_mycol;
+
+static int64_t nverts_known = 0;
+static int *degrees;
+static int64_t *column;
+static twod_csr_graph *cg; //for AM-handlers
+extern twod_csr_graph g; //from bfs_custom_2d for isisolated function
+
+//this function is needed for roots generation
+int isisolated(int64_t v) {
+	if(my_pe()==VERTEX_OWNER(v)) return !(g.nonisolated[VERTEX_LOCAL(v) ulong_shift] & (1UL << (VERTEX_LOCAL(v) ulong_mask)));
+	return 0; //locally no evidence, allreduce required
+}
+
+//grid with BFS_2D_ROWS rows (env), default is as square as possible with rows<=cols
+static void setup_grid(void) {
+	const char* rows = getenv("BFS_2D_ROWS");
+	if(rows != NULL)
+		grid_rows = atoi(rows);
+	else
+		for (grid_rows = 1; grid_rows * grid_rows * 4 <= num_pes() && num_pes() % (grid_rows * 2) == 0; grid_rows *= 2);
+	if(grid_rows <= 0 || num_pes() % grid_rows != 0) {
+		if(!my_pe()) fprintf(stderr, "BFS_2D_ROWS=%d does not divide number of processes %d\n", grid_rows, num_pes());
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	grid_cols = num_pes() / grid_rows;
+	grid_myrow = GRID_ROW_OF_PE(my_pe());
+	grid_mycol = my_pe() % grid_cols;
+	if(!my_pe()) fprintf(stderr, "2D process grid:                %d x %d\n", grid_rows, grid_cols);
+}
+
+static void halfedgehndl(int from,void* data,int sz)
+{  degrees[*(int*)data]++; }
+
+static void fulledgehndl(int frompe,void* data,int sz) {
+	int uloc = *(int*)data;
+	int64_t gtgt = *((int64_t*)(data+4));
+	size_t e = ROWSTART(*cg,uloc) + degrees[uloc]++;
+	SETCOLUMN(e,gtgt);
+}
+
+static void send_half_edge (int64_t src,int64_t tgt) {
+	int uloc=SRC_LOCAL(src);
+	aml_send(&uloc,1,4,EDGE_PE(src,tgt));
+	if(tgt>=nverts_known) nverts_known=tgt+1;
+}
+
+static void send_full_edge (int64_t src,int64_t tgt) {
+	int uloc[3];
+	uloc[0]=SRC_LOCAL(src);
+	memcpy(uloc+1,&tgt,8);
+	aml_send(uloc,1,12,EDGE_PE(src,tgt));
+}
+
+void convert_graph_to_twod_csr(const tuple_graph* const tg, twod_csr_graph* const g) {
+	g->tg = tg;
+
+	size_t i;
+
+	setup_grid();
+
+	int64_t nsrc=tg->nglobaledges/2;
+	nsrc/=grid_cols;
+	nsrc+=1;
+	degrees=xcalloc(nsrc,sizeof(int));
+
+	aml_register_handler(halfedgehndl,1);
+	// First pass : calculate degrees of each source in local block
+	ITERATE_TUPLE_GRAPH_BEGIN(tg, buf, bufsize,wbuf) {
+		ptrdiff_t j;
+		for (j = 0; j < bufsize; ++j) {
+			int64_t v0 = get_v0_from_edge(&buf[j]);
+			int64_t v1 = get_v1_from_edge(&buf[j]);
+			if(v0==v1) continue;
+			send_half_edge(v0, v1);
+			send_half_edge(v1, v0);
+		}
+		aml_barrier();
+	} ITERATE_TUPLE_GRAPH_END;
+
+	aml_long_allmax(&nverts_known);
+	g->nglobalverts = nverts_known+1;
+	g->nlocalverts = VERTEX_LOCAL(g->nglobalverts + num_pes() - 1 - my_pe());
+	g->nlocalsrc = (g->nglobalverts + grid_cols - 1 - grid_mycol) / grid_cols;
+	size_t nlocalsrc = g->nlocalsrc;
+
+	//full degree of a source is sum over its grid column, owner is in same column
+	{
+		MPI_Comm colcomm;
+		int *coldeg = xmalloc(nlocalsrc*sizeof(int));
+		MPI_Comm_split(MPI_COMM_WORLD, grid_mycol, grid_myrow, &colcomm);
+		MPI_Allreduce(degrees, coldeg, nlocalsrc, MPI_INT, MPI_SUM, colcomm);
+		MPI_Comm_free(&colcomm);
+		g->nonisolated = xcalloc((g->nlocalverts + ulong_bits - 1) / ulong_bits, sizeof(unsigned long));
+		for (i = 0; i < g->nlocalverts; ++i)
+			if(coldeg[SRC_LOCAL(VERTEX_TO_GLOBAL(my_pe(),i))])
+				g->nonisolated[i ulong_shift] |= 1UL << (i ulong_mask);
+		free(coldeg);
+	}
+
+	size_t nlocaledges = make_rowstarts(degrees,nlocalsrc,&g->rowstarts,&g->rowbase);
+	g->nlocaledges = nlocaledges;
+	memset(degrees,0,nlocalsrc*sizeof(int)); //edges placed in each row
+	cg = g;
+
+	int64_t colalloc = BYTES_PER_VERTEX*nlocaledges;
+	colalloc += (4095);
+	colalloc /= 4096;
+	colalloc *= 4096;
+	column = xmalloc(colalloc);
+	g->column = column;
+	aml_barrier();
+
+	aml_register_handler(fulledgehndl,1);
+	//Next pass , actual data transfer: placing edges to its places in column
+	ITERATE_TUPLE_GRAPH_BEGIN(tg, buf, bufsize,wbuf) {
+		ptrdiff_t j;
+		for (j = 0; j < bufsize; ++j) {
+			int64_t v0 = get_v0_from_edge(&buf[j]);
+			int64_t v1 = get_v1_from_edge(&buf[j]);
+			if(v0==v1) continue;
+			send_full_edge(v0, v1);
+			send_full_edge(v1, v0);
+		}
+		aml_barrier();
+	} ITERATE_TUPLE_GRAPH_END;
+
+	free(degrees);
+}
+
+void free_twod_csr_graph(twod_csr_graph* const g) {
+	if (g->rowstarts != NULL) {free(g->rowstarts); g->rowstarts = NULL;}
+	if (g->rowbase != NULL) {free(g->rowbase); g->rowbase = NULL;}
+	if (g->column != NULL) {free(g->column); g->column = NULL;}
+	if (g->nonisolated != NULL) {free(g->nonisolated); g->nonisolated = NULL;}
+}
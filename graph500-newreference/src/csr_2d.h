@@ -0,0 +1,45 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+#ifndef CSR_2D_H
+#define CSR_2D_H
+
+#include "common.h"
+#include "csr_reference.h"
+
+// 2D checkerboard edge distribution on a R x C process grid, pe = row*C+col.
+// Vertex state (pred, visited) keeps 1D cyclic VERTEX_OWNER; C must divide size,
+// so all vertices owned by pes of grid column j satisfy v%C==j.
+// Edge u->v is stored on pe in row of VERTEX_OWNER(v) and column of VERTEX_OWNER(u):
+// sources of a pe are u%C==col with local row index u/C, targets are owned by its grid row.
+#define GRID_COL_OF(v) ((int)((v) % grid_cols))
+#define GRID_ROW_OF_PE(p) ((p) / grid_cols)
+#define GRID_PE(r,c) ((r)*grid_cols+(c))
+#define EDGE_PE(u,v) GRID_PE(GRID_ROW_OF_PE(VERTEX_OWNER(v)),GRID_COL_OF(u))
+#define SRC_LOCAL(u) ((size_t)((u) / grid_cols))
+#define SRC_TO_GLOBAL(c,i) ((int64_t)(i)*grid_cols+(c))
+
+extern int grid_rows,grid_cols,grid_myrow,grid_mycol;
+
+typedef struct twod_csr_graph {
+	size_t nlocalverts; //vertices owned in 1D cyclic distribution
+	size_t nlocalsrc; //sources of local edges
+	size_t nlocaledges;
+	int64_t nglobalverts;
+	unsigned int *rowstarts; //indexed by SRC_LOCAL, two-level offsets as in oned_csr_graph
+	int64_t *rowbase;
+	int64_t *column; //global ids of targets
+	unsigned long *nonisolated; //bitmap of owned vertices with edges
+	const tuple_graph* tg;
+} twod_csr_graph;
+
+void convert_graph_to_twod_csr(const tuple_graph* const tg, twod_csr_graph* const g);
+void free_twod_csr_graph(twod_csr_graph* const g);
+
+#endif /* CSR_2D_H */
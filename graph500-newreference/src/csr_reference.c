@@ -8,7 +8,7 @@
 */
 
 // Graph500: Kernel 1: CRS construction
-// Simple two-pass CRS construction using Active Messages
+// Single-pass CRS construction: edges are exchanged by alltoallv and sorted into rows locally
 
 #include "common.h"
 #include "csr_reference.h"
@@ -21,81 +21,449 @@
 #include <stdio.h>
 #include <assert.h>
 #include <search.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 int64_t nverts_known = 0;
 int *degrees;
 int64_t *column;
-float *weights;
+weight_t *weights;
 extern oned_csr_graph g; //from bfs_reference for isisolated function
 
 //this function is needed for roots generation
 int isisolated(int64_t v) {
-	if(my_pe()==VERTEX_OWNER(v)) return (g.rowstarts[VERTEX_LOCAL(v)]==g.rowstarts[VERTEX_LOCAL(v)+1]);
+	if(my_pe()==VERTEX_OWNER(v)) {
+		size_t i = g.perm ? g.perm[VERTEX_LOCAL(v)] : VERTEX_LOCAL(v);
+		return (g.rowstarts[i]==g.rowstarts[i+1]);
+	}
 	return 0; //locally no evidence, allreduce required
 }
 
-void halfedgehndl(int from,void* data,int sz)
-{  degrees[*(int*)data]++; }
+//directed edge as bucketed by owner of its source and exchanged in one block,
+//weight is rounded by sender, so compact weights also shrink the exchange
+typedef struct __attribute__((__packed__)) edgerec {
+	int vloc; //VERTEX_LOCAL of source
+	int64_t tgt;
+#ifdef SSSP
+	weight_t w;
+#endif
+} edgerec;
+
+#ifdef SSSP
+//edges of a row sorted by weight, so light edges for any delta are a prefix of the row
+typedef struct wedge {
+	weight_t w;
+	int64_t v;
+} wedge;
+
+static int compare_wedges(const void* a, const void* b) {
+	const wedge *x = a, *y = b;
+	if(x->w != y->w) return x->w < y->w ? -1 : 1;
+	return x->v < y->v ? -1 : x->v > y->v;
+}
+
+static void sort_rows_by_weight(oned_csr_graph* const g) {
+	size_t i,j,maxdeg = 0;
+	for (i = 0; i < g->nlocalverts; ++i)
+		if(g->rowstarts[i+1] - g->rowstarts[i] > maxdeg) maxdeg = g->rowstarts[i+1] - g->rowstarts[i];
+	wedge *row = xmalloc((maxdeg+1)*sizeof(wedge));
+	for (i = 0; i < g->nlocalverts; ++i) {
+		size_t first = ROWSTART(*g,i), deg = g->rowstarts[i+1] - g->rowstarts[i];
+		if(deg < 2) continue;
+		for (j = 0; j < deg; ++j) {
+			size_t e = first + j;
+			row[j].w = weights[e];
+			row[j].v = COLUMN(e);
+		}
+		qsort(row,deg,sizeof(wedge),compare_wedges);
+		for (j = 0; j < deg; ++j) {
+			size_t e = first + j;
+			weights[e] = row[j].w;
+			SETCOLUMN(e,row[j].v);
+		}
+	}
+	free(row);
+}
+#endif
+
+#ifdef DEDUP_CSR
+typedef struct rowedge {
+	int64_t v;
+#ifdef SSSP
+	weight_t w;
+#endif
+} rowedge;
+
+static int compare_rowedges(const void* a, const void* b) {
+	const rowedge *x = a, *y = b;
+	if(x->v != y->v) return x->v < y->v ? -1 : 1;
+#ifdef SSSP
+	return x->w < y->w ? -1 : x->w > y->w;
+#else
+	return 0;
+#endif
+}
+
+//rows are sorted by target and only first (lightest) copy of each target is kept,
+//rows are moved down in place and column shrinks to edges left
+static void dedup_rows(oned_csr_graph* const g) {
+	size_t i,j,maxdeg = 0,nedges = 0;
+	for (i = 0; i < g->nlocalverts; ++i)
+		if(g->rowstarts[i+1] - g->rowstarts[i] > maxdeg) maxdeg = g->rowstarts[i+1] - g->rowstarts[i];
+	rowedge *row = xmalloc((maxdeg+1)*sizeof(rowedge));
+	int *deduped = xmalloc((g->nlocalverts+1)*sizeof(int));
+	g->inputdeg = xmalloc((g->nlocalverts+1)*sizeof(int));
+	for (i = 0; i < g->nlocalverts; ++i) {
+		size_t first = ROWSTART(*g,i), deg = g->rowstarts[i+1] - g->rowstarts[i];
+		g->inputdeg[i] = deg;
+		deduped[i] = 0;
+		for (j = 0; j < deg; ++j) {
+			size_t e = first + j;
+			row[j].v = COLUMN(e);
+#ifdef SSSP
+			row[j].w = weights[e];
+#endif
+		}
+		qsort(row,deg,sizeof(rowedge),compare_rowedges);
+		for (j = 0; j < deg; ++j) {
+			if(j && row[j].v == row[j-1].v) continue;
+			SETCOLUMN(nedges,row[j].v);
+#ifdef SSSP
+			weights[nedges] = row[j].w;
+#endif
+			nedges++;
+			deduped[i]++;
+		}
+	}
+	free(row);
+	free(g->rowstarts); free(g->rowbase);
+	make_rowstarts(deduped,g->nlocalverts,&g->rowstarts,&g->rowbase);
+	free(deduped);
 
-void fulledgehndl(int frompe,void* data,int sz) {
-	int vloc = *(int*)data;
-	int64_t gtgt = *((int64_t*)(data+4));
-	SETCOLUMN(degrees[vloc]++,gtgt);
+	long before = g->nlocaledges, after = nedges;
+	aml_long_allsum(&before);
+	aml_long_allsum(&after);
+	if(!my_pe()) fprintf(stderr, "duplicate edges removed:        %ld of %ld directed edges\n", before - after, before);
+	g->nlocaledges = nedges;
+	g->column = column = realloc(column,(BYTES_PER_VERTEX*(nedges+1) + 4095) / 4096 * 4096); //never 0 bytes
+	assert(column != NULL);
 #ifdef SSSP
-	float w = ((float*)data)[3];
-	weights[degrees[vloc]-1]=w;
+	g->weights = weights = realloc(weights,sizeof(weight_t)*(nedges+1));
+	assert(weights != NULL);
 #endif
 }
+#endif
 
-void send_half_edge (int64_t src,int64_t tgt) {
-	int pe=VERTEX_OWNER(src);
-	int vloc=VERTEX_LOCAL(src);
-	aml_send(&vloc,1,4,pe);
-	if(tgt>=nverts_known) nverts_known=tgt+1;
+#ifdef COMPRESSED_CSR
+static int compare_targets(const void* a, const void* b) {
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return x < y ? -1 : x > y;
 }
+
+//width code of gap in group varint (see csr_reference.h)
+static inline int group_code(uint64_t x) {
+	return x < (1ULL<<8) ? 0 : x < (1ULL<<16) ? 1 : x < (1ULL<<32) ? 2 : 3;
+}
+
+//rows are sorted in place, then encoded as group varint gaps and 6-byte column is released
+static void compress_rows(oned_csr_graph* const g) {
+	size_t i,j,maxdeg = 0,nbytes = 0;
+	for (i = 0; i < g->nlocalverts; ++i)
+		if(g->rowstarts[i+1] - g->rowstarts[i] > maxdeg) maxdeg = g->rowstarts[i+1] - g->rowstarts[i];
+	int64_t *row = xmalloc((maxdeg+1)*sizeof(int64_t));
+	g->rowbytes = xmalloc((g->nlocalverts+1)*sizeof(size_t));
+	for (i = 0; i < g->nlocalverts; ++i) {
+		size_t first = ROWSTART(*g,i), deg = g->rowstarts[i+1] - g->rowstarts[i];
+		int64_t prev = 0;
+		g->rowbytes[i] = nbytes;
+		for (j = 0; j < deg; ++j) {
+			size_t e = first + j;
+			row[j] = COLUMN(e);
+		}
+		qsort(row,deg,sizeof(int64_t),compare_targets);
+		for (j = 0; j < deg; ++j) {
+			size_t e = first + j;
+			SETCOLUMN(e,row[j]);
+			if(j % 4 == 0) nbytes++; //tag
+			nbytes += GROUP_WIDTH(group_code(row[j] - prev));
+			prev = row[j];
+		}
+	}
+	g->rowbytes[g->nlocalverts] = nbytes;
+	free(row);
+	unsigned char *p = g->colbytes = xcalloc(nbytes+32,1), *tag = NULL; //decoder reads a whole group of 8-byte words
+	for (i = 0; i < g->nlocalverts; ++i) {
+		int64_t prev = 0;
+		for (j = ROWSTART(*g,i); j < ROWEND(*g,i); ++j) {
+			int64_t v = COLUMN(j);
+			uint64_t x = v - prev;
+			int c = group_code(x), w = GROUP_WIDTH(c), k = (j - ROWSTART(*g,i)) % 4;
+			if(k == 0) tag = p++, *tag = 0;
+			*tag |= c << 2*k;
+			prev = v;
+			for(; w; w--, x >>= 8) *p++ = x & 0xff;
+		}
+	}
+	free(g->column);
+	g->column = column = NULL;
+
+	long before = BYTES_PER_VERTEX*g->nlocaledges, after = nbytes + g->nlocalverts*sizeof(size_t);
+	aml_long_allsum(&before);
+	aml_long_allsum(&after);
+	if(!my_pe()) fprintf(stderr, "compressed column:              %.2f of %d bytes per edge with row offsets\n", before ? (double)after*BYTES_PER_VERTEX/before : 0.0, BYTES_PER_VERTEX);
+}
+#endif
+
+//CSR snapshot: with env CSR_SNAPSHOT=<path> each pe writes its CSR to <path>.<pe> after
+//construction, later runs of the same graph and build map it instead of building CSR again.
+//Header is followed by arrays of the graph, each starting at a page boundary.
+#define CSR_SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE 4096
+#define SNAPSHOT_NEXT(off,size) (((off) + (size) + sizeof(int64_t) + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE) //COLUMN reads 8 bytes
+typedef struct csr_snapshot {
+	char magic[8];
+	int version, flags, bytes_per_vertex, row_block_shift, weight_bytes;
+	int scale, edgefactor, npes, pe;
+	uint64_t seed1, seed2;
+	int64_t nglobalverts, notisolated;
+	uint64_t nlocalverts, nlocaledges, colbytes;
+	float maxweight;
+	double avgdegree;
+} csr_snapshot;
+
+typedef struct snapshot_array {
+	void **p;
+	size_t size;
+} snapshot_array;
+
+//key of graph and build in a header, snapshot is used only if it matches in all fields
+static void snapshot_key(csr_snapshot* h, const tuple_graph* const tg) {
+	memset(h, 0, sizeof(csr_snapshot));
+	strcpy(h->magic, "G500CSR");
+	h->version = CSR_SNAPSHOT_VERSION;
 #ifdef SSSP
-void send_full_edge (int64_t src,int64_t tgt,float w) {
-	int pe=VERTEX_OWNER(src);
-	int vloc[4];
-	vloc[0]=VERTEX_LOCAL(src);
-	memcpy(vloc+1,&tgt,8);
-	memcpy(vloc+3,&w,4);
-	aml_send(vloc,1,16,pe);
+	h->flags |= 1;
+#endif
+#ifdef COMPACT_WEIGHTS
+	h->flags |= 2;
+#endif
+#ifdef DEDUP_CSR
+	h->flags |= 4;
+#endif
+#ifdef COMPRESSED_CSR
+	h->flags |= 8;
+#endif
+	h->bytes_per_vertex = BYTES_PER_VERTEX;
+	h->row_block_shift = ROW_BLOCK_SHIFT;
+	h->weight_bytes = sizeof(weight_t);
+	h->scale = tg->scale; h->edgefactor = tg->edgefactor;
+	h->seed1 = tg->seed1; h->seed2 = tg->seed2;
+	h->npes = num_pes(); h->pe = my_pe();
 }
+
+//arrays of g kept in snapshot, their sizes follow from header
+static int snapshot_arrays(oned_csr_graph* const g, const csr_snapshot* h, snapshot_array* a) {
+	int n = 0;
+	a[n].p = (void**)&g->rowstarts; a[n++].size = (h->nlocalverts+1)*sizeof(int);
+	a[n].p = (void**)&g->rowbase; a[n++].size = ((h->nlocalverts>>ROW_BLOCK_SHIFT)+1)*sizeof(int64_t);
+#ifdef COMPRESSED_CSR
+	a[n].p = (void**)&g->colbytes; a[n++].size = h->colbytes;
+	a[n].p = (void**)&g->rowbytes; a[n++].size = (h->nlocalverts+1)*sizeof(size_t);
 #else
-void send_full_edge (int64_t src,int64_t tgt) {
-	int pe=VERTEX_OWNER(src);
-	int vloc[3];
-	vloc[0]=VERTEX_LOCAL(src);
-	memcpy(vloc+1,&tgt,8);
-	aml_send(vloc,1,12,pe);
+	a[n].p = (void**)&g->column; a[n++].size = h->colbytes;
+#endif
+#ifdef SSSP
+	a[n].p = (void**)&g->weights; a[n++].size = h->nlocaledges*sizeof(weight_t);
+#endif
+#ifdef DEDUP_CSR
+	a[n].p = (void**)&g->inputdeg; a[n++].size = (h->nlocalverts+1)*sizeof(int);
+#endif
+	return n;
+}
+
+static char* snapshot_name(const char* path) {
+	char *name = xmalloc(strlen(path)+16);
+	sprintf(name, "%s.%d", path, my_pe());
+	return name;
 }
+
+//collective: maps snapshot of every pe, returns 0 and leaves g untouched unless all pes succeed
+static int load_csr_snapshot(const char* path, const tuple_graph* const tg, oned_csr_graph* const g) {
+	csr_snapshot key, h;
+	snapshot_array a[8];
+	struct stat st;
+	char *name = snapshot_name(path);
+	void *map = MAP_FAILED;
+	size_t off = SNAPSHOT_PAGE;
+	int k, n = 0;
+	long ok = 0;
+	snapshot_key(&key, tg);
+	int fd = open(name, O_RDONLY);
+	if(fd >= 0 && !fstat(fd, &st) && pread(fd, &h, sizeof(h), 0) == sizeof(h)) {
+		//fields of graph size are not part of key
+		memcpy(&key.nglobalverts, &h.nglobalverts, sizeof(h) - offsetof(csr_snapshot,nglobalverts));
+		n = snapshot_arrays(g, &h, a);
+		for(k = 0; k < n; k++) off = SNAPSHOT_NEXT(off, a[k].size);
+		ok = !memcmp(&key, &h, sizeof(h)) && (size_t)st.st_size >= off;
+	}
+	if(ok) {
+		int flags = MAP_PRIVATE; //pages written by relabeling or SSSP sorting stay private
+#ifdef MAP_POPULATE
+		flags |= MAP_POPULATE; //first traversal should not pay for page faults
+#endif
+		map = mmap(NULL, off, PROT_READ|PROT_WRITE, flags, fd, 0);
+		ok = map != MAP_FAILED;
+#ifdef MADV_HUGEPAGE
+		if(ok) madvise(map, off, MADV_HUGEPAGE);
+#endif
+	}
+	if(fd >= 0) close(fd);
+	aml_long_allmin(&ok);
+	if(!ok) {
+		if(map != MAP_FAILED) munmap(map, off);
+		if(!my_pe()) fprintf(stderr, "csr snapshot:                   %s.* not found or not matching, building CSR\n", path);
+		free(name);
+		return 0;
+	}
+	g->snapshot = map; g->snapshotsize = off;
+	for(k = 0, off = SNAPSHOT_PAGE; k < n; k++) {
+		*a[k].p = (char*)map + off;
+		off = SNAPSHOT_NEXT(off, a[k].size);
+	}
+	g->nglobalverts = h.nglobalverts; g->notisolated = h.notisolated;
+	g->nlocalverts = h.nlocalverts; g->nlocaledges = h.nlocaledges;
+	column = g->column;
+#ifdef SSSP
+	weights = g->weights;
+	g->maxweight = h.maxweight; g->avgdegree = h.avgdegree;
+#endif
+	if(!my_pe()) fprintf(stderr, "csr snapshot:                   mapped %s.*\n", path);
+	free(name);
+	return 1;
+}
+
+//collective only for report, file is written to temporary name and renamed when complete
+static void save_csr_snapshot(const char* path, const tuple_graph* const tg, oned_csr_graph* const g) {
+	csr_snapshot h;
+	snapshot_array a[8];
+	char *name = snapshot_name(path), *tmpname = xmalloc(strlen(name)+5);
+	size_t off = SNAPSHOT_PAGE;
+	int k, n;
+	long ok;
+	snapshot_key(&h, tg);
+	h.nglobalverts = g->nglobalverts; h.notisolated = g->notisolated;
+	h.nlocalverts = g->nlocalverts; h.nlocaledges = g->nlocaledges;
+#ifdef COMPRESSED_CSR
+	h.colbytes = g->rowbytes[g->nlocalverts];
+#else
+	h.colbytes = BYTES_PER_VERTEX*g->nlocaledges;
 #endif
+#ifdef SSSP
+	h.maxweight = g->maxweight; h.avgdegree = g->avgdegree;
+#endif
+	n = snapshot_arrays(g, &h, a);
+	sprintf(tmpname, "%s.tmp", name);
+	FILE *f = fopen(tmpname, "wb");
+	ok = f != NULL && fwrite(&h, sizeof(h), 1, f) == 1;
+	for(k = 0; ok && k < n; k++) {
+		ok = !fseek(f, off, SEEK_SET) && fwrite(*a[k].p, 1, a[k].size, f) == a[k].size;
+		off = SNAPSHOT_NEXT(off, a[k].size);
+	}
+	if(ok) ok = !fseek(f, off-1, SEEK_SET) && fputc(0, f) == 0; //padding of last array
+	if(f != NULL && fclose(f)) ok = 0;
+	if(ok) ok = !rename(tmpname, name);
+	else remove(tmpname);
+	aml_long_allmin(&ok);
+	if(!my_pe()) fprintf(stderr, "csr snapshot:                   %s %s.*\n", ok ? "written to" : "failed to write", path);
+	free(name); free(tmpname);
+}
+
+//arrays in a mapped snapshot are released with the mapping
+static void free_csr_array(oned_csr_graph* const g, void* p) {
+	if(g->snapshot == NULL || (char*)p < (char*)g->snapshot || (char*)p >= (char*)g->snapshot + g->snapshotsize) free(p);
+}
 
 void convert_graph_to_oned_csr(const tuple_graph* const tg, oned_csr_graph* const g) {
+	const char* snapshot = getenv("CSR_SNAPSHOT");
 	g->tg = tg;
+	g->perm = NULL; g->inv = NULL;
+	g->snapshot = NULL; g->snapshotsize = 0;
+#ifdef COMPRESSED_CSR
+	g->colbytes = NULL; g->rowbytes = NULL;
+#endif
+#ifdef DEDUP_CSR
+	g->inputdeg = NULL;
+#endif
+#ifdef SSSP
+	g->lightend = NULL;
+#endif
+	if(snapshot != NULL && load_csr_snapshot(snapshot,tg,g)) return;
 
-	size_t i,j,k;
+	size_t i,j;
+	int pe,npes=num_pes();
 
-	int64_t nvert=tg->nglobaledges/2;
-	nvert/=num_pes();
-	nvert+=1;
-	degrees=xcalloc(nvert,sizeof(int));
+	//Single pass over tuple graph: directed edges of every block are bucketed by owner of source
+	//and exchanged with one alltoallv, owner keeps them until CSR is built by local counting sort
+	int *sendcnt=xmalloc(npes*sizeof(int)),*sdispl=xmalloc(npes*sizeof(int)),*fill=xmalloc(npes*sizeof(int));
+	int *recvcnt=xmalloc(npes*sizeof(int)),*rdispl=xmalloc(npes*sizeof(int));
+	edgerec *sendbuf=NULL,*edges=NULL;
+	size_t sendcap=0,nedgerecs=0;
+	//received records are reserved once for expected share of directed edges plus 1/8 slack,
+	//imbalance beyond it grows buffer by small steps, so no doubling overshoots memory
+	size_t edgecap=2*tg->nglobaledges/npes;
+	edgecap+=edgecap/8+1024;
+	edges=xmalloc(edgecap*sizeof(edgerec));
+	MPI_Datatype edgerec_type;
+	MPI_Type_contiguous(sizeof(edgerec),MPI_BYTE,&edgerec_type);
+	MPI_Type_commit(&edgerec_type);
 
-	aml_register_handler(halfedgehndl,1);
-	int numiters=ITERATE_TUPLE_GRAPH_BLOCK_COUNT(tg);
-	// First pass : calculate degrees of each vertex
 	ITERATE_TUPLE_GRAPH_BEGIN(tg, buf, bufsize,wbuf) {
 		ptrdiff_t j;
+		size_t nsend=0,nrecv=0;
+		memset(sendcnt,0,npes*sizeof(int));
 		for (j = 0; j < bufsize; ++j) {
 			int64_t v0 = get_v0_from_edge(&buf[j]);
 			int64_t v1 = get_v1_from_edge(&buf[j]);
 			if(v0==v1) continue;
-			send_half_edge(v0, v1);
-			send_half_edge(v1, v0);
+			sendcnt[VERTEX_OWNER(v0)]++;
+			sendcnt[VERTEX_OWNER(v1)]++;
+			if(v0>=nverts_known) nverts_known=v0+1;
+			if(v1>=nverts_known) nverts_known=v1+1;
 		}
-		aml_barrier();
+		for(pe=0;pe<npes;pe++) sdispl[pe]=fill[pe]=nsend,nsend+=sendcnt[pe];
+		if(nsend>sendcap) {
+			free(sendbuf);
+			sendcap=nsend;
+			sendbuf=xmalloc(sendcap*sizeof(edgerec));
+		}
+		for (j = 0; j < bufsize; ++j) {
+			int64_t v0 = get_v0_from_edge(&buf[j]);
+			int64_t v1 = get_v1_from_edge(&buf[j]);
+			if(v0==v1) continue;
+			edgerec *e0=&sendbuf[fill[VERTEX_OWNER(v0)]++],*e1=&sendbuf[fill[VERTEX_OWNER(v1)]++];
+			e0->vloc=VERTEX_LOCAL(v0); e0->tgt=v1;
+			e1->vloc=VERTEX_LOCAL(v1); e1->tgt=v0;
+#ifdef SSSP
+			e0->w=e1->w=WEIGHT_FROM_FLOAT(wbuf[j]);
+#endif
+		}
+		MPI_Alltoall(sendcnt,1,MPI_INT,recvcnt,1,MPI_INT,MPI_COMM_WORLD);
+		for(pe=0;pe<npes;pe++) rdispl[pe]=nrecv,nrecv+=recvcnt[pe];
+		if(nedgerecs+nrecv>edgecap) {
+			edgecap=nedgerecs+nrecv+edgecap/16;
+			edges=realloc(edges,edgecap*sizeof(edgerec));
+			assert(edges != NULL);
+		}
+		MPI_Alltoallv(sendbuf,sendcnt,sdispl,edgerec_type,edges+nedgerecs,recvcnt,rdispl,edgerec_type,MPI_COMM_WORLD);
+		nedgerecs+=nrecv;
 	} ITERATE_TUPLE_GRAPH_END;
+	free(sendbuf); free(sendcnt); free(sdispl); free(fill); free(recvcnt); free(rdispl);
+	MPI_Type_free(&edgerec_type);
 
 	int64_t nglobalverts = 0;
 	aml_long_allmax(&nverts_known);
@@ -104,6 +472,44 @@ void convert_graph_to_oned_csr(const tuple_graph* const tg, oned_csr_graph* cons
 	size_t nlocalverts = VERTEX_LOCAL(nglobalverts + num_pes() - 1 - my_pe());
 	g->nlocalverts = nlocalverts;
 
+	//records are split in equal chunks, one per thread, and every thread counts its chunk into own
+	//histogram of rows. Histograms take at most as much memory as records, so with many threads
+	//and few records per row less threads are used
+#ifdef _OPENMP
+	int nt = omp_get_max_threads();
+	while(nt > 1 && (size_t)nt*nlocalverts*sizeof(int) > nedgerecs*sizeof(edgerec)) nt--;
+#else
+	int nt = 1;
+#endif
+	int t, *hist=xcalloc((size_t)nt*nlocalverts+1,sizeof(int));
+	//chunks are loop iterations, so all are done even if fewer threads are given
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(static,1)
+#endif
+	for (t = 0; t < nt; t++) {
+		int *h = hist + (size_t)t*nlocalverts;
+		size_t k, last = nedgerecs*(t+1)/nt;
+		for (k = nedgerecs*t/nt; k < last; ++k)
+			h[edges[k].vloc]++;
+	}
+	//degree is a sum of histograms, each histogram becomes offset of its thread in a row:
+	//edges of a thread go after edges of previous threads, scatter needs no atomics and keeps
+	//edges of a row in the same order as serial one
+	degrees=xmalloc((nlocalverts+1)*sizeof(int));
+	degrees[nlocalverts]=0;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (i = 0; i < nlocalverts; ++i) {
+		int tt, sum = 0;
+		for (tt = 0; tt < nt; tt++) {
+			int c = hist[(size_t)tt*nlocalverts+i];
+			hist[(size_t)tt*nlocalverts+i] = sum;
+			sum += c;
+		}
+		degrees[i] = sum;
+	}
+
 	//graph stats printing
 #ifdef DEBUGSTATS
 	long maxdeg=0,isolated=0,totaledges=0,originaledges;
@@ -131,16 +537,7 @@ void convert_graph_to_oned_csr(const tuple_graph* const tg, oned_csr_graph* cons
 
 	g->notisolated=g->nglobalverts-isolated;
 #endif
-	unsigned int *rowstarts = xmalloc((nlocalverts + 1) * sizeof(int));
-	g->rowstarts = rowstarts;
-
-	rowstarts[0] = 0;
-	for (i = 0; i < nlocalverts; ++i) {
-		rowstarts[i + 1] = rowstarts[i] + (i >= nlocalverts ? 0 : degrees[i]);
-		degrees[i] = rowstarts[i];
-	}
-
-	size_t nlocaledges = rowstarts[nlocalverts];
+	size_t nlocaledges = make_rowstarts(degrees,nlocalverts,&g->rowstarts,&g->rowbase);
 	g->nlocaledges = nlocaledges;
 
 	int64_t colalloc = BYTES_PER_VERTEX*nlocaledges;
@@ -148,41 +545,193 @@ void convert_graph_to_oned_csr(const tuple_graph* const tg, oned_csr_graph* cons
 	colalloc /= 4096;
 	colalloc *= 4096;
 	column = xmalloc(colalloc);
-	aml_barrier();
 #ifdef SSSP
-	weights = xmalloc(4*nlocaledges);
+	weights = xmalloc(sizeof(weight_t)*nlocaledges);
 	g->weights = weights;
-	aml_barrier();
 #endif
 	//long allocatededges=colalloc;
 	g->column = column;
 
-	aml_register_handler(fulledgehndl,1);
-	//Next pass , actual data transfer: placing edges to its places in column and hcolumn
-	ITERATE_TUPLE_GRAPH_BEGIN(tg, buf, bufsize,wbuf) {
-		ptrdiff_t j;
-		for (j = 0; j < bufsize; ++j) {
-			int64_t v0 = get_v0_from_edge(&buf[j]);
-			int64_t v1 = get_v1_from_edge(&buf[j]);
-			if(v0==v1) continue;
+#ifdef _OPENMP
+	//first touch of rows by threads in static partition of vertices, as BFS and SSSP loops
+	//over local vertices later use them, so pages of column are spread over NUMA nodes
+#pragma omp parallel for schedule(static)
+	for (i = 0; i < nlocalverts; ++i) {
+		memset((char*)column+BYTES_PER_VERTEX*ROWSTART(*g,i),0,BYTES_PER_VERTEX*degrees[i]);
 #ifdef SSSP
-			send_full_edge(v0, v1,wbuf[j]);
-			send_full_edge(v1, v0,wbuf[j]);
-#else				
-			send_full_edge(v0, v1);
-			send_full_edge(v1, v0);
+		memset(weights+ROWSTART(*g,i),0,sizeof(weight_t)*degrees[i]);
+#endif
+	}
+#endif
+
+	//placing buffered edges to their places in column, every thread its own chunk of records
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(static,1)
+#endif
+	for (t = 0; t < nt; t++) {
+		int *cursor = hist + (size_t)t*nlocalverts;
+		size_t k, last = nedgerecs*(t+1)/nt;
+		for (k = nedgerecs*t/nt; k < last; ++k) {
+			size_t e = ROWSTART(*g,edges[k].vloc) + cursor[edges[k].vloc]++;
+			SETCOLUMN(e,edges[k].tgt);
+#ifdef SSSP
+			weights[e] = edges[k].w;
 #endif
 		}
+	}
+	free(hist);
+	free(edges);
+#ifdef DEDUP_CSR
+	dedup_rows(g);
+#endif
+#ifdef COMPRESSED_CSR
+	compress_rows(g);
+#endif
+	free(degrees);
+#ifdef SSSP
+	sort_rows_by_weight(g);
+
+	long nedges=g->nlocaledges;
+	aml_long_allsum(&nedges);
+	g->avgdegree = (double)nedges/g->nglobalverts;
+	g->maxweight = 0.0;
+	for (i = 0; i < g->nlocaledges; ++i)
+		if(WEIGHT_TO_FLOAT(weights[i]) > g->maxweight) g->maxweight = WEIGHT_TO_FLOAT(weights[i]);
+	MPI_Allreduce(MPI_IN_PLACE, &g->maxweight, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+#endif
+	if(snapshot != NULL) save_csr_snapshot(snapshot,tg,g);
+}
+
+//relabeling: targets of column are translated in rounds of RELABEL_CHUNK local edges,
+//owner of target gets (edge, original local) and answers with relabeled local after barrier
+#define RELABEL_CHUNK (1<<20)
+static int *relabel_perm;
+typedef struct relabelmsg {
+	unsigned int edge; //edge index within round at requesting pe
+	int vloc;
+} relabelmsg;
+static relabelmsg *answers;
+static int *answerpe;
+static size_t nanswers,answercap;
+
+static void relabelreqhndl(int from,void* data,int sz) {
+	relabelmsg *m = data;
+	if(nanswers == answercap) {
+		answercap = answercap ? 2*answercap : 1024;
+		answers = realloc(answers,answercap*sizeof(relabelmsg));
+		answerpe = realloc(answerpe,answercap*sizeof(int));
+		assert(answers != NULL && answerpe != NULL);
+	}
+	answers[nanswers].edge = m->edge;
+	answers[nanswers].vloc = relabel_perm[m->vloc];
+	answerpe[nanswers++] = from;
+}
+
+static size_t relabel_base;
+static void relabelanshndl(int from,void* data,int sz) {
+	relabelmsg *m = data;
+	int64_t v = VERTEX_TO_GLOBAL(from,m->vloc);
+	size_t e = relabel_base+m->edge;
+	SETCOLUMN(e,v);
+}
+
+static unsigned int *relabel_rowstarts;
+static int compare_degrees(const void* a, const void* b) {
+	int x = *(const int*)a, y = *(const int*)b;
+	unsigned int dx = relabel_rowstarts[x+1]-relabel_rowstarts[x], dy = relabel_rowstarts[y+1]-relabel_rowstarts[y];
+	if(dx != dy) return dx > dy ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+//renumber local vertices by decreasing degree, so hot vertices share cache lines of visited, pred and rowstarts
+void relabel_oned_csr(oned_csr_graph* const g) {
+	size_t i,j,k;
+	size_t nlocalverts = g->nlocalverts;
+	column = g->column;
+
+	g->inv = xmalloc((nlocalverts+1)*sizeof(int));
+	g->perm = xmalloc((nlocalverts+1)*sizeof(int));
+	for(i = 0; i < nlocalverts; i++) g->inv[i] = i;
+	relabel_rowstarts = g->rowstarts;
+	qsort(g->inv,nlocalverts,sizeof(int),compare_degrees);
+	for(i = 0; i < nlocalverts; i++) g->perm[g->inv[i]] = i;
+
+	//translate targets to relabeled ids
+	relabel_perm = g->perm;
+	nanswers = 0; answercap = 0; answers = NULL; answerpe = NULL;
+	long nrounds = (g->nlocaledges + RELABEL_CHUNK - 1) / RELABEL_CHUNK;
+	aml_long_allmax(&nrounds);
+	for(k = 0; k < nrounds; k++) {
+		size_t first = k*RELABEL_CHUNK, last = first+RELABEL_CHUNK;
+		if(last > g->nlocaledges) last = g->nlocaledges;
+		aml_register_handler(relabelreqhndl,1);
+		for(j = first; j < last; j++) {
+			int64_t v = COLUMN(j);
+			relabelmsg m = {j-first,VERTEX_LOCAL(v)};
+			aml_send(&m,1,sizeof(relabelmsg),VERTEX_OWNER(v));
+		}
 		aml_barrier();
-	} ITERATE_TUPLE_GRAPH_END;
+		relabel_base = first;
+		aml_register_handler(relabelanshndl,1);
+		for(i = 0; i < nanswers; i++)
+			aml_send(&answers[i],1,sizeof(relabelmsg),answerpe[i]);
+		nanswers = 0;
+		aml_barrier();
+	}
+	free(answers); free(answerpe);
 
-	free(degrees);
+	//move rows to relabeled positions
+	int *newdeg = xmalloc((nlocalverts + 1) * sizeof(int));
+	oned_csr_graph r; //only new row offsets
+	for(i = 0; i < nlocalverts; i++) newdeg[i] = g->rowstarts[g->inv[i]+1]-g->rowstarts[g->inv[i]];
+	make_rowstarts(newdeg,nlocalverts,&r.rowstarts,&r.rowbase);
+	free(newdeg);
+	int64_t colalloc = (BYTES_PER_VERTEX*g->nlocaledges + 4095) / 4096 * 4096;
+	char *newcolumn = xmalloc(colalloc);
+#ifdef SSSP
+	weight_t *newweights = xmalloc(sizeof(weight_t)*g->nlocaledges);
+#endif
+	for(i = 0; i < nlocalverts; i++) {
+		size_t o = g->inv[i], deg = g->rowstarts[o+1]-g->rowstarts[o];
+		memcpy(newcolumn+BYTES_PER_VERTEX*ROWSTART(r,i),((char*)g->column)+BYTES_PER_VERTEX*ROWSTART(*g,o),BYTES_PER_VERTEX*deg);
+#ifdef SSSP
+		memcpy(newweights+ROWSTART(r,i),g->weights+ROWSTART(*g,o),sizeof(weight_t)*deg);
+#endif
+	}
+	free_csr_array(g,g->rowstarts); free_csr_array(g,g->rowbase); free_csr_array(g,g->column);
+	g->rowstarts = r.rowstarts;
+	g->rowbase = r.rowbase;
+	g->column = (int64_t*)newcolumn;
+	column = g->column;
+#ifdef DEDUP_CSR
+	int *inputdeg = xmalloc((nlocalverts+1)*sizeof(int));
+	for(i = 0; i < nlocalverts; i++) inputdeg[i] = g->inputdeg[g->inv[i]];
+	free_csr_array(g,g->inputdeg);
+	g->inputdeg = inputdeg;
+#endif
+#ifdef SSSP
+	free_csr_array(g,g->weights);
+	g->weights = weights = newweights;
+#endif
+	if (g->snapshot != NULL) {munmap(g->snapshot,g->snapshotsize); g->snapshot = NULL;} //all arrays were replaced
 }
 
 void free_oned_csr_graph(oned_csr_graph* const g) {
-	if (g->rowstarts != NULL) {free(g->rowstarts); g->rowstarts = NULL;}
-	if (g->column != NULL) {free(g->column); g->column = NULL;}
+	if (g->rowstarts != NULL) {free_csr_array(g,g->rowstarts); g->rowstarts = NULL;}
+	if (g->rowbase != NULL) {free_csr_array(g,g->rowbase); g->rowbase = NULL;}
+	if (g->column != NULL) {free_csr_array(g,g->column); g->column = NULL;}
+#ifdef COMPRESSED_CSR
+	if (g->colbytes != NULL) {free_csr_array(g,g->colbytes); g->colbytes = NULL;}
+	if (g->rowbytes != NULL) {free_csr_array(g,g->rowbytes); g->rowbytes = NULL;}
+#endif
+#ifdef DEDUP_CSR
+	if (g->inputdeg != NULL) {free_csr_array(g,g->inputdeg); g->inputdeg = NULL;}
+#endif
 #ifdef SSSP
-	if (g->weights != NULL) {free(g->weights); g->weights = NULL;}
+	if (g->weights != NULL) {free_csr_array(g,g->weights); g->weights = NULL;}
+	if (g->lightend != NULL) {free(g->lightend); g->lightend = NULL;}
 #endif
+	if (g->perm != NULL) {free(g->perm); g->perm = NULL;}
+	if (g->inv != NULL) {free(g->inv); g->inv = NULL;}
+	if (g->snapshot != NULL) {munmap(g->snapshot,g->snapshotsize); g->snapshot = NULL;}
 }
@@ -18,17 +18,57 @@ typedef struct oned_csr_graph {
 	size_t nlocaledges;
 	int lg_nglobalverts;
 	int64_t nglobalverts,notisolated;
-	unsigned int *rowstarts;
+	unsigned int *rowstarts; //low 32 bits of row offsets, see ROWSTART
+	int64_t *rowbase; //full offsets of every 1<<ROW_BLOCK_SHIFT-th row
 	int64_t *column;
 #ifdef SSSP 
-	float *weights;
+	weight_t *weights;
+	float maxweight; //largest weight in graph
+	double avgdegree; //directed edges per vertex, for choice of SSSP delta
+	//rows are sorted by weight, first lightend[i] edges of row i are lighter than lightdelta (set by SSSP)
+	unsigned int *lightend;
+	float lightdelta;
 #endif
+#ifdef COMPRESSED_CSR
+	unsigned char *colbytes; //sorted targets of rows as group varint gaps, column is NULL
+	size_t *rowbytes; //offset of each row in colbytes
+#endif
+#ifdef DEDUP_CSR
+	int *inputdeg; //degree before duplicate edges were removed, for TEPS
+#endif
+	void *snapshot; //mapped CSR snapshot holding arrays above, NULL if CSR was built
+	size_t snapshotsize;
+	int *perm; //original VERTEX_LOCAL to relabeled one, NULL if not relabeled
+	int *inv; //relabeled VERTEX_LOCAL to original one
 	const tuple_graph* tg;
 } oned_csr_graph;
 
 void convert_graph_to_oned_csr(const tuple_graph* const tg, oned_csr_graph* const g);
+void relabel_oned_csr(oned_csr_graph* const g);
 void free_oned_csr_graph(oned_csr_graph* const g);
 
+// With RELABEL_CSR local vertices are renumbered by decreasing degree after construction,
+// VERTEX_OWNER is kept and columns hold relabeled global ids. Ids given to or taken
+// from user (roots, pred values and pred indexes) are original ones.
+#ifdef RELABEL_CSR
+#define ORIGINAL_LOCAL(g,i) ((g).inv[i])
+#define RELABELED_LOCAL(g,i) ((g).perm[i])
+#else
+#define ORIGINAL_LOCAL(g,i) (i)
+#define RELABELED_LOCAL(g,i) (i)
+#endif
+
+// With DEDUP_CSR every row keeps one copy of each target (lightest one in SSSP builds).
+// TEPS are counted with degrees of input graph, duplicates included, as rules require.
+#if defined(DEDUP_CSR) && defined(REUSE_CSR_FOR_VALIDATION)
+#error "DEDUP_CSR needs validation building its own CSR, which counts edges of input graph"
+#endif
+#ifdef DEDUP_CSR
+#define INPUT_DEGREE(g,i) ((g).inputdeg[i])
+#else
+#define INPUT_DEGREE(g,i) ((g).rowstarts[(i)+1]-(g).rowstarts[i])
+#endif
+
 //#define BYTES_PER_VERTEX 8
 //#define COLUMN(i) column[i]
 //#define SETCOLUMN(a,b) column[a]=b;
@@ -36,4 +76,65 @@ void free_oned_csr_graph(oned_csr_graph* const g);
 #define SETCOLUMN(a,b) memcpy(((char*)column)+(BYTES_PER_VERTEX*a),&b,BYTES_PER_VERTEX)
 #define COLUMN(i) (*(int64_t*)(((char*)column)+(BYTES_PER_VERTEX*i)) & (int64_t)(0xffffffffffffffffULL>>(64-8*BYTES_PER_VERTEX)))
 
+// Targets of local row u in order of storage, for either column format:
+//	row_iter it; int64_t v;
+//	for(row_begin(&it,&g,u); row_next(&it,&v); ) ...
+// With COMPRESSED_CSR rows are sorted by target and kept as gaps (first target as is)
+// in group varint: a tag byte with 2-bit width codes of next 4 gaps (1,2,4 or 6 bytes),
+// then the gaps little-endian. Offsets of all 4 follow from the tag, so a group is decoded
+// with independent unaligned loads; colbytes is padded for reads past the last group.
+// Degrees still come from rowstarts.
+#define GROUP_WIDTH(c) (((c)<<1)+((c)==0)) //bytes of gap with width code c
+#if defined(COMPRESSED_CSR) && (defined(SSSP) || defined(RELABEL_CSR) || defined(REUSE_CSR_FOR_VALIDATION) || defined(BATCHED_BFS))
+#error "COMPRESSED_CSR is only supported by reference BFS with validation building its own CSR"
+#endif
+typedef struct row_iter {
+#ifdef COMPRESSED_CSR
+	const unsigned char *p; //next group
+	int64_t v[4]; //targets of current group
+	int k; //next of them
+#else
+	const int64_t *column;
+	size_t j;
+#endif
+	size_t n; //targets left
+} row_iter;
+
+static inline void row_begin(row_iter *it, const oned_csr_graph *g, size_t u) {
+	it->n = g->rowstarts[u+1] - g->rowstarts[u];
+#ifdef COMPRESSED_CSR
+	it->p = g->colbytes + g->rowbytes[u];
+	it->v[3] = 0;
+	it->k = 4;
+#else
+	it->column = g->column;
+	it->j = ROWSTART(*g,u);
+#endif
+}
+
+static inline int row_next(row_iter *it, int64_t *v) {
+	if(!it->n) return 0;
+	it->n--;
+#ifdef COMPRESSED_CSR
+	if(it->k == 4) {
+		const unsigned char *p = it->p;
+		unsigned int tag = *p;
+		int w0 = GROUP_WIDTH(tag&3), w1 = GROUP_WIDTH(tag>>2&3), w2 = GROUP_WIDTH(tag>>4&3), w3 = GROUP_WIDTH(tag>>6);
+		int64_t prev = it->v[3];
+		it->v[0] = prev += *(const uint64_t*)(p+1) & ((1ULL<<8*w0)-1);
+		it->v[1] = prev += *(const uint64_t*)(p+1+w0) & ((1ULL<<8*w1)-1);
+		it->v[2] = prev += *(const uint64_t*)(p+1+w0+w1) & ((1ULL<<8*w2)-1);
+		it->v[3] = prev += *(const uint64_t*)(p+1+w0+w1+w2) & ((1ULL<<8*w3)-1);
+		it->p = p+1+w0+w1+w2+w3;
+		it->k = 0;
+	}
+	*v = it->v[it->k++];
+#else
+	const int64_t *column = it->column;
+	size_t j = it->j++;
+	*v = COLUMN(j);
+#endif
+	return 1;
+}
+
 #endif /* CSR_REFERENCE_H */
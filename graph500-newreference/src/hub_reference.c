@@ -0,0 +1,130 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Selection of hub vertices and delegation of their edges to owners of targets (see hub_reference.h)
+
+#include "common.h"
+#include "aml.h"
+#include "hub_reference.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+static hub_graph *hg; //for AM-handlers
+static int *fill;
+
+typedef struct hubedge {
+	int hub; //hub index
+	int vloc; //local target at receiving pe
+} hubedge;
+
+static void counthndl(int from,void* data,int sz)
+{ fill[((hubedge*)data)->hub]++; }
+
+static void fillhndl(int from,void* data,int sz) {
+	hubedge *e = data;
+	hg->column[ROWSTART(*hg,e->hub) + fill[e->hub]++] = e->vloc;
+}
+
+//candidates are (id,parent id,degree), highest degree first, ties by id so all pes get same order
+static int compare_hubs(const void* a, const void* b) {
+	const int64_t *x = a, *y = b;
+	if(x[2] != y[2]) return x[2] > y[2] ? -1 : 1;
+	return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+static void send_hub_edges(const oned_csr_graph* const g, const hub_graph* const h) {
+	row_iter it;
+	int64_t v;
+	int k;
+	for(k = 0; k < h->nhubs; k++)
+		if(VERTEX_OWNER(h->ids[k]) == my_pe()) {
+			size_t vloc = VERTEX_LOCAL(h->ids[k]);
+			for(row_begin(&it,g,vloc); row_next(&it,&v); ) {
+				hubedge e = {k,VERTEX_LOCAL(v)};
+				aml_send(&e,1,sizeof(hubedge),VERTEX_OWNER(v));
+			}
+		}
+	aml_barrier();
+}
+
+void make_hub_graph(const oned_csr_graph* const g, hub_graph* const h) {
+	size_t i;
+	int k,n;
+	memset(h,0,sizeof(hub_graph));
+	if(!HUB_MAX) return;
+
+	long nedges = g->nlocaledges;
+	aml_long_allsum(&nedges);
+	int64_t threshold = HUB_DEGREE_RATIO * (nedges / g->nglobalverts);
+	if(threshold < 1) threshold = 1;
+
+	//gather candidates from all pes
+	int ncand = 0, *counts = xmalloc(num_pes()*sizeof(int)), *displs = xmalloc(num_pes()*sizeof(int));
+	for(i = 0; i < g->nlocalverts; i++)
+		if(g->rowstarts[i+1] - g->rowstarts[i] >= threshold) ncand++;
+	int64_t *cand = xmalloc((3*ncand+1)*sizeof(int64_t));
+	for(i = 0, k = 0; i < g->nlocalverts; i++)
+		if(g->rowstarts[i+1] - g->rowstarts[i] >= threshold) {
+			cand[k++] = VERTEX_TO_GLOBAL(my_pe(),i);
+			cand[k++] = VERTEX_TO_GLOBAL(my_pe(),g->inv ? g->inv[i] : i);
+			cand[k++] = INPUT_DEGREE(*g,i); //counted for TEPS
+		}
+	ncand *= 3;
+	MPI_Allgather(&ncand,1,MPI_INT,counts,1,MPI_INT,MPI_COMM_WORLD);
+	for(k = 0, n = 0; k < num_pes(); k++) displs[k] = n, n += counts[k];
+	int64_t *all = xmalloc((n+1)*sizeof(int64_t));
+	MPI_Allgatherv(cand,ncand,MPI_INT64_T,all,counts,displs,MPI_INT64_T,MPI_COMM_WORLD);
+	free(cand); free(counts); free(displs);
+
+	qsort(all,n/3,3*sizeof(int64_t),compare_hubs);
+	h->nhubs = n/3 < HUB_MAX ? n/3 : HUB_MAX;
+	h->words = (h->nhubs + ulong_bits - 1) / ulong_bits;
+	h->ids = xmalloc((h->nhubs+1)*sizeof(int64_t));
+	h->parents = xmalloc((h->nhubs+1)*sizeof(int64_t));
+	h->degrees = xmalloc((h->nhubs+1)*sizeof(int64_t));
+	for(k = 0; k < h->nhubs; k++) h->ids[k] = all[3*k], h->parents[k] = all[3*k+1], h->degrees[k] = all[3*k+2];
+	free(all);
+	if(!my_pe()) fprintf(stderr, "hub vertices:                   %d (degree >= %" PRId64 ")\n", h->nhubs, h->nhubs ? h->degrees[h->nhubs-1] : threshold);
+	if(!h->nhubs) return;
+
+	uint64_t hashsize = 1;
+	while(hashsize < 2*(uint64_t)h->nhubs) hashsize *= 2;
+	h->hashmask = hashsize - 1;
+	h->hashkeys = xmalloc(hashsize*sizeof(int64_t));
+	h->hashidx = xmalloc(hashsize*sizeof(int));
+	memset(h->hashkeys,-1,hashsize*sizeof(int64_t));
+	for(k = 0; k < h->nhubs; k++) {
+		uint64_t j = h->ids[k] & h->hashmask;
+		while(h->hashkeys[j] != -1) j = (j + 1) & h->hashmask;
+		h->hashkeys[j] = h->ids[k];
+		h->hashidx[j] = k;
+	}
+
+	//two passes as in CSR construction: count delegated edges per hub, then place them
+	hg = h;
+	fill = xcalloc(h->nhubs,sizeof(int));
+	aml_register_handler(counthndl,1);
+	send_hub_edges(g,h);
+	size_t nhubedges = make_rowstarts(fill,h->nhubs,&h->rowstarts,&h->rowbase);
+	memset(fill,0,h->nhubs*sizeof(int));
+	h->column = xmalloc((nhubedges+1)*sizeof(int));
+	aml_register_handler(fillhndl,1);
+	send_hub_edges(g,h);
+	free(fill);
+}
+
+void free_hub_graph(hub_graph* const h) {
+	free(h->ids); free(h->parents); free(h->degrees); free(h->rowstarts); free(h->rowbase); free(h->column);
+	free(h->hashkeys); free(h->hashidx);
+	memset(h,0,sizeof(hub_graph));
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+#ifndef HUB_REFERENCE_H
+#define HUB_REFERENCE_H
+
+#include "common.h"
+#include "csr_reference.h"
+
+// Hub delegation for reference BFS: vertices of degree at least HUB_DEGREE_RATIO times
+// average degree (at most HUB_MAX of them, highest degrees first) are known to all pes.
+// Edges of a hub are copied to owners of their targets, so every pe expands its share of a
+// hub without messages. Visits to hubs are not sent but marked in a replicated bitmap,
+// which is OR-reduced once per level. -DHUB_MAX=0 disables delegation.
+#ifndef HUB_MAX
+#define HUB_MAX 4096
+#endif
+#ifndef HUB_DEGREE_RATIO
+#define HUB_DEGREE_RATIO 64
+#endif
+
+typedef struct hub_graph {
+	int nhubs;
+	int words; //of bitmaps indexed by hub index
+	int64_t *ids; //global ids of hubs
+	int64_t *parents; //ids of hubs given as pred, original ids if CSR was relabeled
+	int64_t *degrees; //full degrees of hubs
+	unsigned int *rowstarts; //delegated edges of hubs with local targets, indexed by hub index
+	int64_t *rowbase; //as in oned_csr_graph
+	int *column; //VERTEX_LOCAL of targets
+	int64_t *hashkeys; //open addressing table of hub ids
+	int *hashidx;
+	uint64_t hashmask;
+} hub_graph;
+
+void make_hub_graph(const oned_csr_graph* const g, hub_graph* const h);
+void free_hub_graph(hub_graph* const h);
+
+//hub index of global vertex v, -1 if v is not a hub
+static inline int hub_index(const hub_graph* const h, int64_t v) {
+	uint64_t i;
+	if(!h->nhubs) return -1;
+	for(i = v & h->hashmask; h->hashkeys[i] != -1; i = (i + 1) & h->hashmask)
+		if(h->hashkeys[i] == v) return h->hashidx[i];
+	return -1;
+}
+
+#endif /* HUB_REFERENCE_H */
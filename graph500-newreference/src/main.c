@@ -21,6 +21,7 @@
 #include "../generator/utils.h"
 #include "aml.h"
 #include "common.h"
+#include "trace.h"
 #include <math.h>
 #include <assert.h>
 #include <string.h>
@@ -70,6 +71,7 @@ void get_statistics(const double x[], int n, volatile double r[s_LAST]) {
 int main(int argc, char** argv) {
 	aml_init(&argc,&argv); //includes MPI_Init inside
 	setup_globals();
+	trace_init();
 
 	/* Parse arguments. */
 	int SCALE = 16;
@@ -98,6 +100,8 @@ int main(int argc, char** argv) {
 
 	tuple_graph tg;
 	tg.nglobaledges = (int64_t)(edgefactor) << SCALE;
+	tg.scale = SCALE; tg.edgefactor = edgefactor;
+	tg.seed1 = seed1; tg.seed2 = seed2;
 	int64_t nglobalverts = (int64_t)(1) << SCALE;
 
 	tg.data_in_file = (filename != NULL);
@@ -363,18 +367,40 @@ int main(int argc, char** argv) {
 			int64_t nedges=0;
 			validate_result(1,&tg, nlocalverts, bfs_roots[0], pred,shortest,NULL);
 		}
+#ifdef BATCHED_BFS
+		int batch_first = 0, batch_end = 0;
+		double batch_time = 0;
+#endif
 
 		for (bfs_root_idx = 0; bfs_root_idx < num_bfs_roots; ++bfs_root_idx) {
 			int64_t root = bfs_roots[bfs_root_idx];
 
 			if (rank == 0) fprintf(stderr, "Running BFS %d\n", bfs_root_idx);
+#ifdef BATCHED_BFS
+			/* Roots are traversed in batches, batch time is shared evenly and each
+			 * root adds time of extracting its predecessors. */
+			if (bfs_root_idx == batch_end) {
+				double batch_start = MPI_Wtime();
+				int n = run_bfs_batch(num_bfs_roots - bfs_root_idx, &bfs_roots[bfs_root_idx]);
+				batch_time = (MPI_Wtime() - batch_start) / n;
+				batch_first = bfs_root_idx;
+				batch_end = bfs_root_idx + n;
+			}
+#endif
 
 			clean_pred(&pred[0]); //user-provided function from bfs_implementation.c
 			/* Do the actual BFS. */
 			double bfs_start = MPI_Wtime();
+#ifdef BATCHED_BFS
+			get_bfs_batch_pred(bfs_root_idx - batch_first, &pred[0]);
+#else
 			run_bfs(root, &pred[0]);
+#endif
 			double bfs_stop = MPI_Wtime();
 			bfs_times[bfs_root_idx] = bfs_stop - bfs_start;
+#ifdef BATCHED_BFS
+			bfs_times[bfs_root_idx] += batch_time;
+#endif
 			if (rank == 0) fprintf(stderr, "Time for BFS %d is %f\n", bfs_root_idx, bfs_times[bfs_root_idx]);
 			int64_t edge_visit_count=0;
 			get_edge_count_for_teps(&edge_visit_count);
@@ -466,6 +492,9 @@ int main(int argc, char** argv) {
 	MPI_Free_mem(shortest);
 #endif
 	free(bfs_roots);
+#ifdef BATCHED_BFS
+	free_bfs_batch();
+#endif
 	free_graph_data_structure();
 
 	if (tg.data_in_file) {
@@ -568,6 +597,10 @@ int main(int argc, char** argv) {
 			fprintf(stdout, "sssp max_validate:              %g\n", stats[s_maximum]);
 			fprintf(stdout, "sssp mean_validate:             %g\n", stats[s_mean]);
 			fprintf(stdout, "sssp stddev_validate:           %g\n", stats[s_std]);
+#ifdef COMPACT_WEIGHTS
+			fprintf(stdout, "sssp weight_error_bound:        %g\n", WEIGHT_ERROR);
+			fprintf(stdout, "sssp max_weight_error:          %g\n", validate_weight_error);
+#endif
 #endif
 #if 0
 			for (i = 0; i < num_bfs_roots; ++i) {
@@ -585,6 +618,7 @@ int main(int argc, char** argv) {
 	free(sssp_times);
 	free(validate_times2);
 #endif
+	trace_finish();
 	cleanup_globals();
 	aml_finalize(); //includes MPI_Finalize()
 	return 0;
@@ -1,25 +1,319 @@
-// Stub for custom SSSP implementation
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Graph500: Kernel 3 SSSP
+// Hybrid of delta-stepping and Bellman-Ford, in the spirit of direction-optimizing BFS of bfs_custom.c:
+// a step either settles the lowest bucket (light rounds, then heavy edges) or is one Bellman-Ford
+// round which relaxes all edges of every pending vertex (distance changed since its last relaxation)
+// whatever its bucket. Bellman-Ford rounds are taken when pending vertices carry many edges
+// (dense middle phase, one round replaces many buckets) and when few pending vertices are left
+// compared to reached ones (sparse tail of nearly empty buckets, each costing barriers).
+// Both kinds of steps relax all edges of a vertex after its last change, so result is exact
+// once no vertex is pending.
 
 #include "aml.h"
 #include "common.h"
 #include "csr_reference.h"
 #include "bitmap_reference.h"
+#include "trace.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
 
 extern oned_csr_graph g;
-extern int64_t* column,*pred_glob,visited_size;
+extern int *q1,*q2;
+extern unsigned int *rowstarts;
+extern int64_t *column,*pred_glob,visited_size;
 extern unsigned long * visited;
+extern int64_t tepsedges;
+extern int64_t nglobaledges_csr; //from bfs_custom.c, set before make_sssp_data_structure
 
 #ifdef SSSP
 
+//default bucket width is SSSP_DELTA_FACTOR*maxweight/avgdegree as in sssp_reference.c
+#ifndef SSSP_DELTA_FACTOR
+#define SSSP_DELTA_FACTOR 1.0
+#endif
+//Bellman-Ford round if edges of pending vertices exceed all edges / SSSP_ALPHA
+#ifndef SSSP_ALPHA
+#define SSSP_ALPHA 4
+#endif
+//Bellman-Ford round if pending vertices are fewer than reached ones / SSSP_BETA
+#ifndef SSSP_BETA
+#define SSSP_BETA 64
+#endif
+
+static float *glob_dist;
+static float glob_delta;
+static weight_t *weights;
+
+//buckets with lazy deletion as in sssp_reference.c, entry is valid if inbucket of its vertex points to bucket
+typedef struct bucket {
+	int *v;
+	int64_t n,cap;
+} bucket;
+static bucket *buckets;
+static int64_t nbuckets;
+static int *inbucket; //-1 if vertex is not pending (all -1 between runs)
+static int64_t curbucket,curadded;
+enum { PEND_N, PEND_M, REACHED, STAT_LAST };
+static int64_t stats[STAT_LAST]; //pending vertices, their edges and reached vertices of this pe
+
+static void bucket_push(int64_t b, int vloc) {
+	if(inbucket[vloc] == b) return;
+	if(inbucket[vloc] == -1) stats[PEND_N]++,stats[PEND_M]+=rowstarts[vloc+1]-rowstarts[vloc];
+	inbucket[vloc] = b;
+	if(b >= nbuckets) {
+		int64_t n = nbuckets ? nbuckets : 64;
+		while(n <= b) n *= 2;
+		buckets = realloc(buckets,n*sizeof(bucket));
+		assert(buckets != NULL);
+		memset(buckets+nbuckets,0,(n-nbuckets)*sizeof(bucket));
+		nbuckets = n;
+	}
+	bucket *bk = &buckets[b];
+	if(bk->n == bk->cap) {
+		bk->cap = bk->cap ? 2*bk->cap : 256;
+		bk->v = realloc(bk->v,bk->cap*sizeof(int));
+		assert(bk->v != NULL);
+	}
+	bk->v[bk->n++] = vloc;
+	if(b == curbucket) curadded++;
+}
+
+//vertex taken out of bucket b for relaxation, 0 if entry is stale
+static inline int bucket_take(int64_t b, int vloc) {
+	if(inbucket[vloc] != b) return 0;
+	inbucket[vloc] = -1;
+	stats[PEND_N]--; stats[PEND_M]-=rowstarts[vloc+1]-rowstarts[vloc];
+	return 1;
+}
+
+static int64_t next_bucket(int64_t b) {
+	int64_t i;
+	for(; b < nbuckets; b++) {
+		for(i = 0; i < buckets[b].n; i++)
+			if(inbucket[buckets[b].v[i]] == b) return b;
+		free(buckets[b].v);
+		memset(&buckets[b],0,sizeof(bucket));
+	}
+	return INT64_MAX;
+}
+
+typedef struct  __attribute__((__packed__)) relaxmsg {
+	float w; //distance offered to destination
+	int dest_vloc;
+	int src_vloc;
+} relaxmsg;
+
+static void relaxhndl(int from, void* dat, int sz) {
+	relaxmsg* m = (relaxmsg*) dat;
+	int vloc = m->dest_vloc;
+	float w = m->w;
+	float *dest_dist = &glob_dist[vloc];
+	if (*dest_dist < 0 || *dest_dist > w) {
+		if (*dest_dist < 0) {
+			tepsedges += INPUT_DEGREE(g,vloc);
+			stats[REACHED]++;
+		}
+		*dest_dist = w;
+		pred_glob[vloc]=VERTEX_TO_GLOBAL(from,m->src_vloc);
+		bucket_push((int64_t)(w/glob_delta),vloc);
+	}
+}
+
+//sender-side cache of best distance sent to remote vertices, as in sssp_reference.c
+#ifndef RELAX_CACHE_BYTES
+#define RELAX_CACHE_BYTES (1UL<<26)
+#endif
+static float *sentdist; //NaN is never less or equal
+static int64_t *sentkeys,sentsize;
+static uint64_t sentmask;
+
+static inline void send_relax(int64_t glob, float weight,int fromloc) {
+	int pe=VERTEX_OWNER(glob);
+	if(pe!=my_pe()) {
+		if(sentkeys==NULL) {
+			if(sentdist[glob]<=weight) return;
+			sentdist[glob]=weight;
+		} else {
+			uint64_t i=glob&sentmask;
+			if(sentkeys[i]==glob && sentdist[i]<=weight) return;
+			sentkeys[i]=glob; sentdist[i]=weight;
+		}
+	}
+	relaxmsg m = {weight,VERTEX_LOCAL(glob),fromloc};
+	aml_send(&m,1,sizeof(relaxmsg),pe);
+}
+
+//light/heavy split of rows sorted by weight (see csr_reference.c), recomputed if delta changes
+static void split_rows(float delta) {
+	size_t i;
+	if(g.lightend != NULL && g.lightdelta == delta) return;
+	if(g.lightend == NULL) g.lightend = xmalloc((g.nlocalverts+1)*sizeof(int));
+	for(i=0;i<g.nlocalverts;i++) {
+		size_t first=ROWSTART(g,i);
+		unsigned int lo=0,hi=rowstarts[i+1]-rowstarts[i];
+		while(lo<hi) {
+			unsigned int mid=lo+(hi-lo)/2;
+			if(WEIGHT_TO_FLOAT(weights[first+mid])<delta) lo=mid+1; else hi=mid;
+		}
+		g.lightend[i]=lo;
+	}
+	g.lightdelta=delta;
+}
+
+//called from make_graph_data_structure and free_graph_data_structure of bfs_custom
+void make_sssp_data_structure(void) {
+	int64_t i;
+	inbucket=xmalloc(g.nlocalverts*sizeof(int));
+	for(i=0;i<g.nlocalverts;i++) inbucket[i]=-1;
+	sentkeys=NULL;
+	if(g.nglobalverts*sizeof(float) <= RELAX_CACHE_BYTES)
+		sentsize=g.nglobalverts;
+	else {
+		sentsize=RELAX_CACHE_BYTES/(sizeof(float)+sizeof(int64_t));
+		while(sentsize&(sentsize-1)) sentsize&=sentsize-1;
+		sentmask=sentsize-1;
+		sentkeys=xmalloc(sentsize*sizeof(int64_t));
+	}
+	sentdist=xmalloc(sentsize*sizeof(float));
+}
+
+void free_sssp_data_structure(void) {
+	free(inbucket); free(sentdist); free(sentkeys);
+}
+
+//delta-stepping step: light rounds until bucket b is empty everywhere, then heavy edges of its vertices
+static void bucket_step(int64_t b, int64_t* nfront, int64_t* nscan) {
+	int64_t j,k,sum=1,nsettled=0;
+	unsigned int *lightend=g.lightend;
+	curbucket=b;
+	while(sum!=0) {
+		bucket cur={NULL,0,0};
+		if(b<nbuckets) cur=buckets[b],memset(&buckets[b],0,sizeof(bucket));
+		curadded=0;
+		for(k=0;k<cur.n;k++) {
+			int u=cur.v[k];
+			if(!bucket_take(b,u)) continue;
+			if(!TEST_VISITEDLOC(u)) {
+				SET_VISITEDLOC(u);
+				q1[nsettled++]=u;
+			}
+			(*nfront)++;
+			*nscan+=rowstarts[u+1]-rowstarts[u];
+			size_t first=ROWSTART(g,u),light=first+lightend[u];
+			for(j=first;j<light;j++)
+				send_relax(COLUMN(j),glob_dist[u]+WEIGHT_TO_FLOAT(weights[j]),u);
+		}
+		free(cur.v);
+		trace_phase(TRACE_BARRIER);
+		aml_barrier_allreduce(&curadded,&sum,1,AML_SUM);
+		trace_phase(TRACE_EXPAND);
+	}
+	curbucket=-1;
+	for(k=0;k<nsettled;k++) {
+		int u=q1[k];
+		CLEAR_VISITEDLOC(u);
+		size_t first=ROWSTART(g,u),last=ROWEND(g,u);
+		for(j=first+lightend[u];j<last;j++)
+			send_relax(COLUMN(j),glob_dist[u]+WEIGHT_TO_FLOAT(weights[j]),u);
+	}
+	trace_phase(TRACE_BARRIER);
+	aml_barrier();
+	trace_phase(TRACE_EXPAND);
+}
+
+//Bellman-Ford round: all edges of all pending vertices, taken out before sending so that
+//improvements made by this round are pending for the next one
+static void bellman_ford_step(int64_t* nfront, int64_t* nscan) {
+	int64_t b,j,k,n=0;
+	for(b=next_bucket(0);b<nbuckets;b++) {
+		for(k=0;k<buckets[b].n;k++)
+			if(bucket_take(b,buckets[b].v[k]))
+				q1[n++]=buckets[b].v[k];
+		buckets[b].n=0;
+	}
+	for(k=0;k<n;k++) {
+		int u=q1[k];
+		*nscan+=rowstarts[u+1]-rowstarts[u];
+		size_t first=ROWSTART(g,u),last=ROWEND(g,u);
+		for(j=first;j<last;j++)
+			send_relax(COLUMN(j),glob_dist[u]+WEIGHT_TO_FLOAT(weights[j]),u);
+	}
+	*nfront+=n;
+	trace_phase(TRACE_BARRIER);
+	aml_barrier();
+	trace_phase(TRACE_EXPAND);
+}
+
 //user provided function to be called several times to implement kernel 3: single source shortest path
 //function has filled with -1 and 1.0 pred and dist arrays
 //at exit dist should have shortest distance to root for each vertice otherwise -1
 //pred array should point to next vertie in shortest path or -1 if vertex unreachable
 //pred[VERTEX_LOCAL(root)] should be root and dist should be 0.0
-
 void run_sssp(int64_t root,int64_t* pred,float *dist) {
+	int64_t i,b,sum[STAT_LAST];
+	const char* env = getenv("SSSP_DELTA");
+
+	glob_delta = env ? atof(env) : SSSP_DELTA_FACTOR*g.maxweight/g.avgdegree; //see choice of delta in sssp_reference.c
+	if(!(glob_delta > 0.0)) glob_delta = 0.1;
+	glob_dist=dist;
+	weights=g.weights;
 	pred_glob=pred;
-	//user code for SSSP
+	tepsedges=0;
+	split_rows(glob_delta);
+	CLEAN_VISITED();
+	if(sentkeys) memset(sentkeys,-1,sentsize*sizeof(int64_t));
+	else memset(sentdist,-1,sentsize*sizeof(float));
+	buckets=NULL; nbuckets=0;
+	curbucket=-1;
+	stats[PEND_N]=0; stats[PEND_M]=0; stats[REACHED]=0;
+
+	aml_register_handler(relaxhndl,1);
+	trace_begin("sssp",root);
+
+	if (VERTEX_OWNER(root) == my_pe()) {
+		dist[VERTEX_LOCAL(root)]=0.0;
+		pred[VERTEX_LOCAL(root)]=root;
+		tepsedges=INPUT_DEGREE(g,VERTEX_LOCAL(root));
+		stats[REACHED]=1;
+		bucket_push(0,VERTEX_LOCAL(root));
+	}
+	aml_barrier_allreduce(stats,sum,STAT_LAST,AML_SUM);
+
+	while(sum[PEND_N]!=0) {
+		int64_t nfront=0,nscan=0;
+		trace_level_begin();
+		int bf = sum[PEND_M] > nglobaledges_csr/SSSP_ALPHA || sum[PEND_N]*SSSP_BETA < sum[REACHED];
+		if(bf)
+			bellman_ford_step(&nfront,&nscan);
+		else {
+			b=next_bucket(0);
+			trace_phase(TRACE_BARRIER);
+			aml_barrier_allreduce(&b,&b,1,AML_MIN);
+			trace_phase(TRACE_EXPAND);
+			bucket_step(b,&nfront,&nscan);
+		}
+		trace_phase(TRACE_BARRIER);
+		aml_barrier_allreduce(stats,sum,STAT_LAST,AML_SUM);
+		trace_level_end(nfront,nscan);
+#ifdef DEBUGSTATS
+		if(!my_pe()) printf("--%s step: %lld pending (%lld edges), %lld reached\n",bf?"BF":"DS",sum[PEND_N],sum[PEND_M],sum[REACHED]);
+#endif
+	}
+
+	for(i=0;i<nbuckets;i++) free(buckets[i].v);
+	free(buckets);
+	buckets=NULL; nbuckets=0;
 }
 
 //user provided function to prefill dist array with whatever value
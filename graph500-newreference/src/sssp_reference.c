@@ -8,145 +8,466 @@
 */
 
 // Graph500: Kernel 3 SSSP
-// Simple parallel delta-stepping with relaxations as Active Messages
+// Simple parallel delta-stepping with relaxations as Active Messages, threaded with OpenMP if enabled
 
 #include "aml.h"
 #include "common.h"
 #include "csr_reference.h"
 #include "bitmap_reference.h"
+#include "trace.h"
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+#include <stdio.h>
 
 #ifdef DEBUGSTATS
 extern int64_t nbytes_sent,nbytes_rcvd;
 #endif
 // variables shared from bfs_reference
 extern oned_csr_graph g;
-extern int qc,q2c;
+extern int64_t qc,q2c;
 extern int* q1,*q2;
 extern int* rowstarts;
 extern int64_t* column,*pred_glob,visited_size;
 extern unsigned long * visited;
+extern int64_t tepsedges;
 #ifdef SSSP
 //global variables as those accesed by active message handler
 float *glob_dist;
-float glob_maxdelta, glob_mindelta; //range for current bucket
-float *weights;
-volatile int lightphase;
+float glob_delta;
+weight_t *weights;
 
-//Relaxation data type 
+//relaxations are scanned by OpenMP threads (if enabled) and staged per destination pe as in BFS,
+//handler only queues improving relaxations into inbox. After delivery threads apply the inbox
+//with atomic min on distpred and push improved vertices into their own buckets
+#ifdef _OPENMP
+#include <omp.h>
+#define THREAD_ID omp_get_thread_num()
+#else
+#define THREAD_ID 0
+#endif
+#define RELAX_BATCH 64
+extern int nthreads; //of bfs_reference
+
+//distance (bits of non-negative float, ordered as integers) in high half, 1+inbox index of
+//relaxation which set it in low half, 0 once pred is taken from inbox. All ones if not reached
+static uint64_t *distpred;
+
+static inline uint32_t float_bits(float f) { uint32_t u; memcpy(&u,&f,sizeof(u)); return u; }
+static inline float bits_float(uint32_t u) { float f; memcpy(&f,&u,sizeof(f)); return f; }
+
+//buckets of delta-stepping: vertices with floor(dist/delta)==b are listed in bucket b.
+//lists are appended on every improvement and never searched, deletion is lazy:
+//entry is valid only if inbucket of its vertex still points to this bucket.
+//every thread has its own lists, vertex is pushed only by thread which applied its improvement
+typedef struct bucket {
+	int *v;
+	int64_t n,cap;
+} bucket;
+
+//Relaxation data type
 typedef struct  __attribute__((__packed__)) relaxmsg {
 	float w; //weight of an edge
 	int dest_vloc; //local index of destination vertex
 	int src_vloc; //local index of source vertex
 } relaxmsg;
 
-// Active message handler for relaxation
+typedef struct sssp_thread {
+	bucket *buckets;
+	int64_t nbuckets;
+	int *settled; //vertices settled in current bucket by this thread (its part of R)
+	int64_t nsettled,settledcap;
+	relaxmsg *stage; //RELAX_BATCH relaxations for each pe
+	int *stagec;
+	int64_t tepsedges; //degrees of vertices reached first time
+	int64_t nfront,nscan; //for trace
+} __attribute__((aligned(64))) sssp_thread;
+
+static sssp_thread *sthreads;
+static int *inbucket; //bucket with a pending entry of vertex, -1 if none (all -1 between runs)
+static int64_t curbucket,curadded; //bucket being processed, relaxations into it received in light phase
+
+//relaxation received in current round
+typedef struct relaxation {
+	float w;
+	int vloc;
+	int64_t pred;
+} relaxation;
+static relaxation *inbox;
+static int64_t ninbox,inboxcap;
+
+static void bucket_push(sssp_thread *t, int64_t b, int vloc) {
+	if(inbucket[vloc] == b) return; //already pending there
+	inbucket[vloc] = b;
+	if(b >= t->nbuckets) {
+		int64_t n = t->nbuckets ? t->nbuckets : 64;
+		while(n <= b) n *= 2;
+		t->buckets = realloc(t->buckets,n*sizeof(bucket));
+		assert(t->buckets != NULL);
+		memset(t->buckets+t->nbuckets,0,(n-t->nbuckets)*sizeof(bucket));
+		t->nbuckets = n;
+	}
+	bucket *bk = &t->buckets[b];
+	if(bk->n == bk->cap) {
+		bk->cap = bk->cap ? 2*bk->cap : 256;
+		bk->v = realloc(bk->v,bk->cap*sizeof(int));
+		assert(bk->v != NULL);
+	}
+	bk->v[bk->n++] = vloc;
+}
+
+//first bucket from b on with a valid entry in any thread, stale buckets are released on the way
+static int64_t next_bucket(int64_t b) {
+	int64_t i,min=INT64_MAX;
+	int t;
+	for(t = 0; t < nthreads; t++) {
+		sssp_thread *th = &sthreads[t];
+		int64_t c;
+		for(c = b; c < th->nbuckets && c < min; c++) {
+			for(i = 0; i < th->buckets[c].n; i++)
+				if(inbucket[th->buckets[c].v[i]] == c) break;
+			if(i < th->buckets[c].n) { min = c; break; }
+			free(th->buckets[c].v);
+			memset(&th->buckets[c],0,sizeof(bucket));
+		}
+	}
+	return min;
+}
+
+static inline void improve(sssp_thread *th, int vloc, float w, int64_t pred) {
+	if(glob_dist[vloc] < 0) th->tepsedges += INPUT_DEGREE(g,vloc); //first time reached
+	glob_dist[vloc] = w;
+	pred_glob[vloc] = pred;
+	bucket_push(th,(int64_t)(w/glob_delta),vloc);
+}
+
+// Active message handler for batch of relaxations, AML calls are serialized and distances do not
+// change until inbox is applied, so relaxations which can not improve are dropped here.
+// Without threads relaxations are applied at once
 void relaxhndl(int from, void* dat, int sz) {
 	relaxmsg* m = (relaxmsg*) dat;
-	int vloc = m->dest_vloc;
-	float w = m->w;
-	float *dest_dist = &glob_dist[vloc];
-	//check if relaxation is needed: either new path is shorter or vertex not reached earlier
-	if (*dest_dist < 0 || *dest_dist > w) {
-		*dest_dist = w; //update distance
-		pred_glob[vloc]=VERTEX_TO_GLOBAL(from,m->src_vloc); //update path
-
-		if(lightphase && !TEST_VISITEDLOC(vloc)) //Bitmap used to track if was already relaxed with light edge
-		{
-			if(w < glob_maxdelta) { //if falls into current bucket needs further reprocessing
-				q2[q2c++] = vloc;
-				SET_VISITEDLOC(vloc);
+	int i;
+	for(i = 0; i < sz/sizeof(relaxmsg); i++) {
+		int vloc = m[i].dest_vloc;
+		float w = m[i].w;
+		if(glob_dist[vloc] >= 0 && glob_dist[vloc] <= w) continue;
+		if((int64_t)(w/glob_delta) == curbucket) curadded++;
+		if(nthreads == 1) {
+			improve(&sthreads[0],vloc,w,VERTEX_TO_GLOBAL(from,m[i].src_vloc));
+			continue;
+		}
+		if(ninbox == inboxcap) {
+			inboxcap = inboxcap ? 2*inboxcap : 4096;
+			inbox = realloc(inbox,inboxcap*sizeof(relaxation));
+			assert(inbox != NULL);
+		}
+		inbox[ninbox].w = w;
+		inbox[ninbox].vloc = vloc;
+		inbox[ninbox].pred = VERTEX_TO_GLOBAL(from,m[i].src_vloc);
+		ninbox++;
+	}
+}
+
+//apply received relaxations: lock-free min of packed (dist,inbox index) per vertex, then the
+//thread whose relaxation won sets dist and pred and pushes vertex into its bucket
+static void apply_inbox(void) {
+	int64_t i;
+	if(!ninbox) return;
+	assert(ninbox < UINT32_MAX);
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+	{
+		sssp_thread *th = &sthreads[THREAD_ID];
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for(i = 0; i < ninbox; i++) {
+			uint64_t *dp = &distpred[inbox[i].vloc];
+			uint64_t nv = (uint64_t)float_bits(inbox[i].w) << 32 | (uint64_t)(i+1);
+			uint64_t old = *dp;
+#ifdef _OPENMP
+			while(nv < old) {
+				uint64_t seen = __sync_val_compare_and_swap(dp,old,nv);
+				if(seen == old) break;
+				old = seen;
 			}
+#else
+			if(nv < old) *dp = nv;
+#endif
+		}
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for(i = 0; i < ninbox; i++) {
+			int vloc = inbox[i].vloc;
+			if((uint32_t)distpred[vloc] != (uint32_t)(i+1)) continue;
+			distpred[vloc] &= ~(uint64_t)UINT32_MAX;
+			improve(th,vloc,inbox[i].w,inbox[i].pred);
 		}
 	}
+	ninbox = 0;
 }
 
-//Sending relaxation active message
-void send_relax(int64_t glob, float weight,int fromloc) {
-	relaxmsg m = {weight,VERTEX_LOCAL(glob),fromloc};
-	aml_send(&m,1,sizeof(relaxmsg),VERTEX_OWNER(glob));
+//bucket width: env SSSP_DELTA if given, otherwise SSSP_DELTA_FACTOR*maxweight/avgdegree,
+//so that a light phase relaxes about SSSP_DELTA_FACTOR light edges per vertex
+#ifndef SSSP_DELTA_FACTOR
+#define SSSP_DELTA_FACTOR 1.0
+#endif
+static float choose_delta(void) {
+	static int printed = 0;
+	const char* env = getenv("SSSP_DELTA");
+	float delta = env ? atof(env) : SSSP_DELTA_FACTOR*g.maxweight/g.avgdegree;
+	if(!(delta > 0.0)) delta = 0.1; //empty graph or bad SSSP_DELTA
+	if(!printed && !my_pe()) fprintf(stderr, "SSSP delta:                     %g\n", delta);
+	printed = 1;
+	return delta;
+}
+
+//split rows into light and heavy edges for delta, only if delta changed since last run
+static void split_rows(float delta) {
+	size_t i;
+	if(g.lightend != NULL && g.lightdelta == delta) return;
+	if(g.lightend == NULL) g.lightend = xmalloc((g.nlocalverts+1)*sizeof(int));
+	for(i=0;i<g.nlocalverts;i++) {
+		size_t first=ROWSTART(g,i);
+		unsigned int lo=0,hi=rowstarts[i+1]-rowstarts[i];
+		while(lo<hi) { //first edge not lighter than delta, rows are sorted by weight
+			unsigned int mid=lo+(hi-lo)/2;
+			if(WEIGHT_TO_FLOAT(weights[first+mid])<delta) lo=mid+1; else hi=mid;
+		}
+		g.lightend[i]=lo;
+	}
+	g.lightdelta=delta;
+}
+
+//sender-side cache of best distance sent to remote vertices in current run: relaxation which
+//is not better than one already sent can not improve target. Exact array of all global vertices
+//if it fits into RELAX_CACHE_BYTES, otherwise direct-mapped cache of recently targeted vertices.
+//Threads race on entries, but an entry only ever holds a distance which was really sent
+#ifndef RELAX_CACHE_BYTES
+#define RELAX_CACHE_BYTES (1UL<<26)
+#endif
+static float *sentdist; //NaN (all bits set) is never less or equal, so empty entries let relaxation pass
+static uint64_t *sentcache; //glob>>sentbits in high half and float bits of distance in low half, all ones if empty
+static int64_t sentsize;
+static int sentbits;
+
+static void send_stage(sssp_thread *t, int pe) {
+#ifdef _OPENMP
+#pragma omp critical(aml)
+#endif
+	aml_send(t->stage+pe*RELAX_BATCH,1,t->stagec[pe]*sizeof(relaxmsg),pe);
+	t->stagec[pe]=0;
+}
+
+//Staging relaxation active message
+static inline void send_relax(sssp_thread *t, int64_t glob, float weight,int fromloc) {
+	int pe=VERTEX_OWNER(glob);
+	if(pe!=my_pe()) {
+		if(sentcache==NULL) {
+			if(sentdist[glob]<=weight) return;
+			sentdist[glob]=weight;
+		} else {
+			uint64_t *e=&sentcache[glob&(sentsize-1)],tag=(uint64_t)glob>>sentbits,cur=*e;
+			if(cur>>32==tag && bits_float((uint32_t)cur)<=weight) return;
+			*e=tag<<32|float_bits(weight);
+		}
+	}
+	relaxmsg *m = t->stage+pe*RELAX_BATCH+t->stagec[pe]++;
+	m->w = weight;
+	m->dest_vloc = VERTEX_LOCAL(glob);
+	m->src_vloc = fromloc;
+	if(t->stagec[pe] == RELAX_BATCH) send_stage(t,pe);
+}
+
+static void flush_stages(sssp_thread *t) {
+	int pe;
+	for(pe=0;pe<num_pes();pe++)
+		if(t->stagec[pe]) send_stage(t,pe);
+}
+
+//called from make_graph_data_structure and free_graph_data_structure of bfs_reference
+void make_sssp_data_structure(void) {
+	int64_t i;
+	inbucket=xmalloc(g.nlocalverts*sizeof(int));
+	for(i=0;i<g.nlocalverts;i++) inbucket[i]=-1;
+	distpred=xmalloc(g.nlocalverts*sizeof(uint64_t));
+	inbox=NULL; ninbox=0; inboxcap=0;
+	sentdist=NULL; sentcache=NULL;
+	if(g.nglobalverts*sizeof(float) <= RELAX_CACHE_BYTES) {
+		sentsize=g.nglobalverts;
+		sentdist=xmalloc(sentsize*sizeof(float));
+	} else {
+		for(sentbits=0;(2UL<<sentbits)*sizeof(uint64_t)<=RELAX_CACHE_BYTES;sentbits++);
+		sentsize=1L<<sentbits;
+		assert((uint64_t)(g.nglobalverts-1)>>sentbits < UINT32_MAX); //tag fits and differs from empty
+		sentcache=xmalloc(sentsize*sizeof(uint64_t));
+	}
+	sthreads=xmalloc(nthreads*sizeof(sssp_thread));
+	for(i=0;i<nthreads;i++) {
+		memset(&sthreads[i],0,sizeof(sssp_thread));
+		sthreads[i].stage=xmalloc(num_pes()*RELAX_BATCH*sizeof(relaxmsg));
+		sthreads[i].stagec=xcalloc(num_pes(),sizeof(int));
+	}
+}
+
+void free_sssp_data_structure(void) {
+	int i;
+	for(i=0;i<nthreads;i++) {
+		free(sthreads[i].settled); free(sthreads[i].stage); free(sthreads[i].stagec);
+	}
+	free(sthreads);
+	free(inbucket); free(distpred); free(inbox); free(sentdist); free(sentcache);
 }
 
 void run_sssp(int64_t root,int64_t* pred,float *dist) {
 
-	unsigned int i,j;
-	long sum=0;
+	int64_t i,j,k;
+	int64_t sum=0,b;
+	int t;
 
-	float delta = 0.1;
-	glob_mindelta=0.0;
-	glob_maxdelta=delta;
+	float delta = choose_delta();
+	glob_delta=delta;
 	glob_dist=dist;
 	weights=g.weights;
 	pred_glob=pred;
-	qc=0;q2c=0;
+	tepsedges=0;
+	split_rows(delta);
+	unsigned int *lightend=g.lightend;
+	//settled vertices of current bucket (R of delta-stepping) are collected in settled lists of threads and marked in visited
+	CLEAN_VISITED();
+	for(t=0;t<nthreads;t++) sthreads[t].buckets=NULL,sthreads[t].nbuckets=0,sthreads[t].tepsedges=0;
+	curbucket=-1;
+	ninbox=0;
+	memset(distpred,-1,g.nlocalverts*sizeof(uint64_t));
+	if(sentcache) memset(sentcache,-1,sentsize*sizeof(uint64_t));
+	else memset(sentdist,-1,sentsize*sizeof(float));
 
 	aml_register_handler(relaxhndl,1);
+	trace_begin("sssp",root);
 
 	if (VERTEX_OWNER(root) == my_pe()) {
-		q1[0]=VERTEX_LOCAL(root);
-		qc=1;
 		dist[VERTEX_LOCAL(root)]=0.0;
+		distpred[VERTEX_LOCAL(root)]=0;
 		pred[VERTEX_LOCAL(root)]=root;
+		tepsedges=INPUT_DEGREE(g,VERTEX_LOCAL(root));
+		bucket_push(&sthreads[0],0,VERTEX_LOCAL(root));
 	}
 
-	aml_barrier();
-	sum=1;
+	b=next_bucket(0);
+	aml_barrier_allreduce(&b,&b,1,AML_MIN);
 
-	int64_t lastvisited=1;
-	while(sum!=0) {
+	while(b!=INT64_MAX) {
 #ifdef DEBUGSTATS
 		double t0 = aml_time();
+		int64_t b0 = b;
 		nbytes_sent=0;
 #endif
-		//1. iterate over light edges
+		int64_t nfront=0,nscan=0; //vertices processed in bucket and their edges, for trace
+		trace_level_begin();
+		curbucket=b;
+		for(t=0;t<nthreads;t++) sthreads[t].nsettled=0,sthreads[t].nfront=0,sthreads[t].nscan=0;
+		//1. iterate over light edges while bucket is not empty on any pe
+		sum=1;
 		while(sum!=0) {
-			CLEAN_VISITED();
-			lightphase=1;
-			aml_barrier();
-			for(i=0;i<qc;i++)
-				for(j=rowstarts[q1[i]];j<rowstarts[q1[i]+1];j++)
-					if(weights[j]<delta)
-						send_relax(COLUMN(j),dist[q1[i]]+weights[j],q1[i]);
-			aml_barrier();
-
-			qc=q2c;q2c=0;int *tmp=q1;q1=q2;q2=tmp;
-			sum=qc;
-			aml_long_allsum(&sum);
+			//entries added from now on are processed in next round
+			bucket *cur=xmalloc(nthreads*sizeof(bucket));
+			for(t=0;t<nthreads;t++) {
+				memset(&cur[t],0,sizeof(bucket));
+				if(b<sthreads[t].nbuckets) cur[t]=sthreads[t].buckets[b],memset(&sthreads[t].buckets[b],0,sizeof(bucket));
+			}
+			curadded=0;
+			trace_phase(TRACE_EXPAND);
+#ifdef _OPENMP
+#pragma omp parallel private(j,k,t)
+#endif
+			{
+				sssp_thread *th = &sthreads[THREAD_ID];
+				for(t=0;t<nthreads;t++) {
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+					for(k=0;k<cur[t].n;k++) {
+						int u=cur[t].v[k];
+						if(inbucket[u]!=b) continue; //stale entry
+						inbucket[u]=-1;
+						if(!TEST_AND_SET_VISITEDLOC(u)) {
+							if(th->nsettled==th->settledcap) {
+								th->settledcap=th->settledcap ? 2*th->settledcap : 1024;
+								th->settled=realloc(th->settled,th->settledcap*sizeof(int));
+								assert(th->settled != NULL);
+							}
+							th->settled[th->nsettled++]=u;
+						}
+						th->nfront++;
+						size_t first=ROWSTART(g,u),light=first+lightend[u];
+						th->nscan+=lightend[u];
+						for(j=first;j<light;j++)
+							send_relax(th,COLUMN(j),dist[u]+WEIGHT_TO_FLOAT(weights[j]),u);
+					}
+				}
+				flush_stages(th);
+			}
+			for(t=0;t<nthreads;t++) free(cur[t].v);
+			free(cur);
+			trace_phase(TRACE_BARRIER);
+			aml_barrier_allreduce(&curadded,&sum,1,AML_SUM);
+			trace_phase(TRACE_EXPAND);
+			apply_inbox();
 		}
-		lightphase=0;
-		aml_barrier();
+		curbucket=-1;
 
-		//2. iterate over S and heavy edges
-		for(i=0;i<g.nlocalverts;i++)
-			if(dist[i]>=glob_mindelta && dist[i] < glob_maxdelta) {
-				for(j=rowstarts[i];j<rowstarts[i+1];j++)
-					if(weights[j]>=delta)
-						send_relax(COLUMN(j),dist[i]+weights[j],i);
+		//2. heavy edges of vertices settled in this bucket
+#ifdef _OPENMP
+#pragma omp parallel private(j,k,t)
+#endif
+		{
+			sssp_thread *th = &sthreads[THREAD_ID];
+			for(t=0;t<nthreads;t++) {
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+				for(k=0;k<sthreads[t].nsettled;k++) {
+					int u=sthreads[t].settled[k];
+					size_t first=ROWSTART(g,u),last=ROWEND(g,u);
+					th->nscan+=last-first-lightend[u];
+					for(j=first+lightend[u];j<last;j++)
+						send_relax(th,COLUMN(j),dist[u]+WEIGHT_TO_FLOAT(weights[j]),u);
+				}
 			}
+			flush_stages(th);
+		}
+		trace_phase(TRACE_BARRIER);
 		aml_barrier();
+		trace_phase(TRACE_EXPAND);
+		apply_inbox();
 
-		glob_mindelta=glob_maxdelta;
-		glob_maxdelta+=delta;
-		qc=0;sum=0;
-
-		//3. Bucket processing and checking termination condition
-		int64_t lvlvisited=0;
-		for(i=0;i<g.nlocalverts;i++)
-			if(dist[i]>=glob_mindelta) {
-				sum++; //how many are still to be processed
-				if (dist[i] < glob_maxdelta)
-					q1[qc++]=i; //this is lowest bucket
-			} else if(dist[i]!=-1.0) lvlvisited++;
-		aml_long_allsum(&sum);
+		//3. unmark settled vertices and find lowest nonempty bucket on any pe
+		for(t=0;t<nthreads;t++) {
+			for(k=0;k<sthreads[t].nsettled;k++) CLEAR_VISITEDLOC(sthreads[t].settled[k]);
+			nfront+=sthreads[t].nfront; nscan+=sthreads[t].nscan;
+		}
+		b=next_bucket(b);
+		trace_phase(TRACE_BARRIER);
+		aml_barrier_allreduce(&b,&b,1,AML_MIN);
+		trace_level_end(nfront,nscan);
 #ifdef DEBUGSTATS
 		t0-=aml_time();
-		aml_long_allsum(&lvlvisited);
+		aml_long_allsum(&nfront);
 		aml_long_allsum(&nbytes_sent);
-		if(!my_pe()) printf("--lvl[%1.2f..%1.2f] visited %lld (total %llu) in %5.2fs, network aggr %5.2fGb/s\n",glob_mindelta,glob_maxdelta,lvlvisited-lastvisited,lvlvisited,-t0,-(double)nbytes_sent*8.0/(1.e9*t0));
-		lastvisited = lvlvisited;
+		if(!my_pe()) printf("--bucket[%lld] processed %lld in %5.2fs, network aggr %5.2fGb/s\n",b0,nfront,-t0,-(double)nbytes_sent*8.0/(1.e9*t0));
 #endif
 	}
 
+	for(t=0;t<nthreads;t++) {
+		sssp_thread *th=&sthreads[t];
+		for(i=0;i<th->nbuckets;i++) free(th->buckets[i].v);
+		free(th->buckets);
+		th->buckets=NULL; th->nbuckets=0;
+		tepsedges+=th->tepsedges;
+	}
 }
 
 void clean_shortest(float* dist) {
@@ -0,0 +1,153 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+// Per-level trace of traversals (see trace.h)
+
+#include "common.h"
+#include "aml.h"
+#include "trace.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+typedef struct trace_row {
+	char kernel[8];
+	int run; //traversal number on this pe, warm-up runs included
+	int level;
+	int pe;
+	int64_t root;
+	int64_t frontier;
+	int64_t edges;
+	uint64_t msgs;
+	uint64_t bytes;
+	double t[TRACE_PHASES];
+} trace_row;
+
+int trace_enabled = 0;
+static const char* trace_file;
+static trace_row *rows;
+static size_t nrows, rowcap;
+
+static trace_row cur; //level being recorded
+static int curphase;
+static double tphase, treduce; //start of current phase, AML reduction time at that moment
+static uint64_t msgs0, bytes0;
+
+void trace_init(void) {
+	trace_file = getenv("GRAPH500_TRACE");
+	trace_enabled = trace_file != NULL;
+	nrows = 0; rowcap = 0; rows = NULL;
+	cur.run = -1;
+}
+
+void trace_begin(const char* kernel, int64_t root) {
+	if(!trace_enabled) return;
+	strncpy(cur.kernel, kernel, sizeof(cur.kernel)-1);
+	cur.run++;
+	cur.level = 0;
+	cur.pe = my_pe();
+	cur.root = root;
+}
+
+void trace_level_begin(void) {
+	if(!trace_enabled) return;
+	memset(cur.t, 0, sizeof(cur.t));
+	aml_get_stats(&msgs0, &bytes0, &treduce);
+	curphase = TRACE_EXPAND;
+	tphase = aml_time();
+}
+
+void trace_phase(int phase) {
+	uint64_t m, b;
+	double r, now;
+	if(!trace_enabled) return;
+	now = aml_time();
+	aml_get_stats(&m, &b, &r);
+	//reduction inside of aml_barrier_allreduce is moved out of the phase it was called in
+	cur.t[curphase] += now - tphase - (r - treduce);
+	cur.t[TRACE_ALLREDUCE] += r - treduce;
+	tphase = now; treduce = r;
+	curphase = phase;
+}
+
+void trace_level_end(int64_t frontier, int64_t edges) {
+	double r;
+	if(!trace_enabled) return;
+	trace_phase(curphase);
+	aml_get_stats(&cur.msgs, &cur.bytes, &r);
+	cur.msgs -= msgs0; cur.bytes -= bytes0;
+	cur.frontier = frontier;
+	cur.edges = edges;
+	if(nrows == rowcap) {
+		rowcap = rowcap ? 2*rowcap : 1024;
+		rows = realloc(rows, rowcap*sizeof(trace_row));
+		assert(rows != NULL);
+	}
+	rows[nrows++] = cur;
+	cur.level++;
+}
+
+//CSV text of rows of this pe, header is written by pe 0
+static char* format_rows(size_t* len) {
+	size_t i, cap = 128 + nrows*160, n = 0;
+	char *text = xmalloc(cap);
+	if(!my_pe()) n += sprintf(text, "kernel,run,root,level,pe,frontier,edges,msgs,bytes,expand_s,barrier_s,allreduce_s\n");
+	for(i = 0; i < nrows; i++) {
+		trace_row *r = &rows[i];
+		int w;
+		while((w = snprintf(text+n, cap-n, "%s,%d,%" PRId64 ",%d,%d,%" PRId64 ",%" PRId64 ",%" PRIu64 ",%" PRIu64 ",%.9f,%.9f,%.9f\n",
+						r->kernel, r->run, r->root, r->level, r->pe, r->frontier, r->edges, r->msgs, r->bytes,
+						r->t[TRACE_EXPAND], r->t[TRACE_BARRIER], r->t[TRACE_ALLREDUCE])) >= (int)(cap-n)) {
+			cap *= 2;
+			text = realloc(text, cap);
+			assert(text != NULL);
+		}
+		n += w;
+	}
+	*len = n;
+	return text;
+}
+
+//every pe writes its rows with MPI-IO at offset given by exclusive scan of text sizes, so
+//nothing is gathered to pe 0 and offsets are 64-bit
+void trace_finish(void) {
+	size_t len, done;
+	long long mylen, offset = 0;
+	MPI_File f;
+	MPI_Status st;
+	MPI_Errhandler eh;
+	int err;
+	if(!trace_enabled) return;
+	char *text = format_rows(&len);
+	mylen = len;
+	MPI_Exscan(&mylen, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+	if(!my_pe()) offset = 0; //undefined on pe 0
+	MPI_File_get_errhandler(MPI_FILE_NULL, &eh);
+	MPI_File_set_errhandler(MPI_FILE_NULL, MPI_ERRORS_RETURN);
+	err = MPI_File_open(MPI_COMM_WORLD, (char*)trace_file, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &f);
+	MPI_File_set_errhandler(MPI_FILE_NULL, eh);
+	if(err != MPI_SUCCESS) {
+		if(!my_pe()) fprintf(stderr, "Cannot open trace file %s\n", trace_file);
+	} else {
+		MPI_File_set_size(f, 0);
+		for(done = 0; done < len; ) { //count of MPI-IO calls is int
+			int chunk = len-done > (1<<30) ? (1<<30) : (int)(len-done);
+			MPI_File_write_at(f, offset+done, text+done, chunk, MPI_CHAR, &st);
+			done += chunk;
+		}
+		MPI_File_close(&f);
+		if(!my_pe()) fprintf(stderr, "trace written to %s\n", trace_file);
+	}
+	free(text);
+	free(rows);
+	rows = NULL; nrows = 0; rowcap = 0;
+}
@@ -0,0 +1,37 @@
+/* Copyright (c) 2011-2017 Graph500 Steering Committee
+   All rights reserved.
+   Developed by:                Anton Korzh anton@korzh.us
+                                Graph500 Steering Committee
+                                http://www.graph500.org
+   New code under University of Illinois/NCSA Open Source License
+   see license.txt or https://opensource.org/licenses/NCSA
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Per-level trace of BFS and SSSP, enabled at runtime by env GRAPH500_TRACE=<file>.
+// Every pe records one row per level (bucket for SSSP) of every traversal: its frontier size,
+// edges scanned, AM sent and time split into phases. trace_finish writes rows of all pes to
+// one CSV file with MPI-IO, so per-level breakdown and imbalance between pes can be seen.
+// Without GRAPH500_TRACE all calls return at once.
+
+enum trace_phase {
+	TRACE_EXPAND, //local work: scanning edges, sending AM, bucket selection
+	TRACE_BARRIER, //delivery of AM and waiting for other pes
+	TRACE_ALLREDUCE, //reductions, aml_barrier_allreduce is split by AML counters
+	TRACE_PHASES
+};
+
+extern int trace_enabled;
+
+void trace_init(void); //reads GRAPH500_TRACE, called once after aml_init
+void trace_begin(const char* kernel, int64_t root); //new traversal
+void trace_level_begin(void); //starts a level in TRACE_EXPAND phase
+void trace_phase(int phase); //time from now on is counted to given phase
+void trace_level_end(int64_t frontier, int64_t edges); //records a row for finished level
+void trace_finish(void); //collective: writes file and frees rows
+
+#endif /* TRACE_H */
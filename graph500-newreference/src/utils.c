@@ -13,6 +13,9 @@
 #include <mpi.h>
 #include <assert.h>
 #include "common.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 int rank, size;
 #ifdef SIZE_MUST_BE_A_POWER_OF_TWO
@@ -74,3 +77,59 @@ void* xMPI_Alloc_mem(size_t nbytes) {
 	}
 	return p;
 }
+
+//two-level offsets of rows with given degrees (see csr_reference.h), returns number of edges
+size_t make_rowstarts(const int* degrees, size_t nrows, unsigned int** rowstarts, int64_t** rowbase) {
+	size_t nblocks = (nrows >> ROW_BLOCK_SHIFT) + 1, nedges = 0;
+	unsigned int *rs = xmalloc((nrows + 1) * sizeof(int));
+	int64_t *rb = xmalloc(nblocks * sizeof(int64_t));
+#ifdef _OPENMP
+	size_t *part = xmalloc((omp_get_max_threads() + 1) * sizeof(size_t));
+#else
+	size_t part[2];
+#endif
+	//every thread takes whole blocks of rows, sums their degrees and after exclusive scan of
+	//the sums fills its rows starting at its offset, so rows are first touched in static partition
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+#ifdef _OPENMP
+		int t = omp_get_thread_num(), nt = omp_get_num_threads();
+#else
+		int t = 0, nt = 1;
+#endif
+		size_t i, offset = 0;
+		size_t first = (nblocks * t / nt) << ROW_BLOCK_SHIFT, last = (nblocks * (t + 1) / nt) << ROW_BLOCK_SHIFT;
+		if (first > nrows + 1) first = nrows + 1;
+		if (last > nrows + 1) last = nrows + 1;
+		for (i = first; i < last && i < nrows; ++i) offset += degrees[i];
+		part[t + 1] = offset;
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+		{
+			part[0] = 0;
+			for (i = 0; i < (size_t)nt; ++i) part[i + 1] += part[i];
+			nedges = part[nt];
+		}
+		offset = part[t];
+		for (i = first; i < last; ++i) {
+			if (!(i & ((1 << ROW_BLOCK_SHIFT) - 1)))
+				rb[i >> ROW_BLOCK_SHIFT] = offset;
+			else if (offset - rb[i >> ROW_BLOCK_SHIFT] > UINT32_MAX) {
+				fprintf(stderr, "%d: rows of a block of %d have more than 2^32 edges, decrease ROW_BLOCK_SHIFT\n", rank, 1 << ROW_BLOCK_SHIFT);
+				MPI_Abort(MPI_COMM_WORLD, 1);
+			}
+			rs[i] = (unsigned int)offset;
+			if (i < nrows) offset += degrees[i];
+		}
+	}
+#ifdef _OPENMP
+	free(part);
+#endif
+	*rowstarts = rs;
+	*rowbase = rb;
+	return nedges;
+}
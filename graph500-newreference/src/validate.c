@@ -25,13 +25,15 @@
 #include <assert.h>
 #include <search.h>
 #include <float.h>
+#include <math.h>
 
 #ifdef REUSE_CSR_FOR_VALIDATION
 #include "csr_reference.h"
 extern int64_t* column;
 extern unsigned int* rowstarts;
+extern int64_t* rowbase;
 #ifdef SSSP
-extern float* weights;
+extern weight_t* weights;
 #endif
 #else
 #define SETCOLUMN(a,b) vcolumn[a]=b
@@ -41,10 +43,27 @@ int firstvalidationrun=1;
 //int failedttovalidate=0; 
 int validatingbfs=0;
 
-unsigned int *vdegrees,*vrowstarts;
+int *vdegrees;
+unsigned int *vrowstarts;
+int64_t *vrowbase;
+#define VROWSTART(i) ROW_OFFSET(vrowstarts,vrowbase,i)
+#define VROWEND(i) (VROWSTART(i) + (unsigned int)(vrowstarts[(i)+1] - vrowstarts[i]))
 int64_t *vcolumn;
 #ifdef SSSP
+#ifdef REUSE_CSR_FOR_VALIDATION
+weight_t* vweights;
+#define VWEIGHT(e) WEIGHT_TO_FLOAT(vweights[e])
+#else
 float* vweights;
+#define VWEIGHT(e) vweights[e]
+#endif
+#endif
+#ifdef COMPACT_WEIGHTS
+//SSSP ran on rounded weights: distances may break triangle rule and pred edges may differ
+//from exact sums by the rounding error of one edge weight
+float validate_weight_error=0.0;
+static float weighterror;
+static float *confirmerr; //smallest error of an edge to pred, pred is confirmed if within rounding error
 #endif
 int64_t *globpred,nedges_traversed;
 float *globdist,prevlevel;
@@ -80,7 +99,7 @@ void send_half (int64_t src) {
 void vfulledgehndl(int frompe,void* data,int sz) {
 	int vloc = *(int*)data;
 	int64_t gtgt = *((int64_t*)(data+4));
-	int next = vdegrees[vloc]++;
+	size_t next = VROWSTART(vloc) + vdegrees[vloc]++;
 	SETCOLUMN(next,gtgt);
 #ifdef SSSP
 	vweights[next] = ((float*)data)[3];
@@ -110,10 +129,10 @@ typedef struct edgedist {
 #endif
 } edgedist;
 
-void sendedgepreddist(unsigned vloc,unsigned int vedge) {
+void sendedgepreddist(unsigned vloc,size_t vedge) {
 	edgedist m = {vloc,VERTEX_LOCAL(COLUMN(vedge)),globpred[vloc],globdist[vloc]
 #ifdef SSSP
-		,vweights[vedge]
+		,VWEIGHT(vedge)
 #endif
 	};
 	aml_send(&m,1,sizeof(edgedist),VERTEX_OWNER(COLUMN(vedge)));
@@ -141,14 +160,25 @@ void edgepreddisthndl(int frompe,void* data,int sz) {
 	if(predv0==-1 && predv1==-1) return; else if(v0<v1) nedges_traversed++;
 
 	if((predv0==-1 && predv1!=-1) || (predv1==-1 && predv0!=-1)) DUMPERROR("edge connecting visited and unvisited vertices");
+#ifdef COMPACT_WEIGHTS
+	float eps = validatingbfs ? 0.0 : WEIGHT_ERROR, err;
+	if(predv1==v0) { //pred and dist are confirmed after all edges are seen
+		err = fabsf(distv1-(distv0+w));
+		if(err < confirmerr[v1loc]) confirmerr[v1loc] = err;
+	}
+	err = distv1-(distv0+w) > distv0-(distv1+w) ? distv1-(distv0+w) : distv0-(distv1+w);
+	if(err > eps) DUMPERROR("triangle rule violated");
+	if(err > weighterror) weighterror = err;
+#else
 	if(predv1==v0 && distv1 == distv0+w) confirmed[v1loc]=1; //confirm pred/dist as existing edge
 
 	if(distv0+w < distv1 || distv1+w<distv0) DUMPERROR("triangle rule violated");
+#endif
 }
 
 void makedepthmapforbfs(const size_t nlocalverts,const int64_t root,int64_t * const pred,float* dist) {
 
-	int i,j;
+	size_t i,j;
 	for(i=0;i<nlocalverts;i++) {
 		dist[i]=FLT_MAX; //at the end there should be no FLT_MAX left
 		if(pred[i]==-1) dist[i]=-1.0;
@@ -168,7 +198,7 @@ void makedepthmapforbfs(const size_t nlocalverts,const int64_t root,int64_t * co
 
 		for(i=0;i<nlocalverts;i++)
 			if(dist[i]==prevlevel)
-				for(j=vrowstarts[i];j<vrowstarts[i+1];j++)
+				for(j=VROWSTART(i);j<VROWEND(i);j++)
 					send_frompred(i,COLUMN(j));
 		aml_barrier();
 
@@ -185,8 +215,12 @@ int validate_result(int isbfs,const tuple_graph* const tg, const size_t nlocalve
 	if(firstvalidationrun) {
 		firstvalidationrun=0;
 		confirmed = xmalloc(nlocalverts*sizeof(int));
+#ifdef COMPACT_WEIGHTS
+		confirmerr = xmalloc(nlocalverts*sizeof(float));
+#endif
 #ifdef REUSE_CSR_FOR_VALIDATION
 vrowstarts=rowstarts;
+vrowbase=rowbase;
 #ifdef SSSP
 vweights=weights;
 #endif
@@ -209,17 +243,12 @@ vweights=weights;
 			aml_barrier();
 		} ITERATE_TUPLE_GRAPH_END;
 
-		vrowstarts = xmalloc((nlocalverts + 1) * sizeof(int));
+		size_t nedges = make_rowstarts(vdegrees,nlocalverts,&vrowstarts,&vrowbase);
+		memset(vdegrees,0,nlocalverts*sizeof(int)); //edges placed in each row
 
-		vrowstarts[0] = 0;
-		for (i = 0; i < nlocalverts; ++i) {
-			vrowstarts[i + 1] = vrowstarts[i] + (i >= nlocalverts ? 0 : vdegrees[i]);
-			vdegrees[i] = vrowstarts[i];
-		}
-
-		vcolumn = xmalloc(8*vrowstarts[nlocalverts]);
+		vcolumn = xmalloc(8*nedges);
 #ifdef SSSP
-		vweights = xmalloc(4*vrowstarts[nlocalverts]);
+		vweights = xmalloc(4*nedges);
 #endif
 		aml_register_handler(vfulledgehndl,1);
 		//Second pass , actual data transfer: placing edges to its places in vcolumn
@@ -280,11 +309,23 @@ vweights=weights;
 
 	aml_register_handler(edgepreddisthndl,1);
 	nedges_traversed=0;
+#ifdef COMPACT_WEIGHTS
+	weighterror=0.0;
+	for (i = 0; i < nlocalverts; ++i)
+		confirmerr[i]=FLT_MAX;
+#endif
 
 	for (i = 0; i < nlocalverts; ++i)
-		for(j = vrowstarts[i];j<vrowstarts[i+1];j++)
+		for(j = VROWSTART(i);j<VROWEND(i);j++)
 			sendedgepreddist(i,j);
 	aml_barrier();
+#ifdef COMPACT_WEIGHTS
+	for (i = 0; i < nlocalverts; ++i)
+		if(confirmerr[i] <= (validatingbfs ? 0.0 : WEIGHT_ERROR)) {
+			confirmed[i]=1;
+			if(confirmerr[i] > weighterror) weighterror = confirmerr[i];
+		}
+#endif
 
 	for (i = 0; i < nlocalverts; ++i)
 		if(confirmed[i]==0 && pred[i]!=-1) 
@@ -292,6 +333,10 @@ vweights=weights;
 
 	aml_long_allsum(&val_errors);
 	aml_long_allsum(&nedges_traversed);
+#ifdef COMPACT_WEIGHTS
+	MPI_Allreduce(MPI_IN_PLACE,&weighterror,1,MPI_FLOAT,MPI_MAX,MPI_COMM_WORLD);
+	if(weighterror > validate_weight_error) validate_weight_error = weighterror;
+#endif
 	if(nedges_in!=NULL && *nedges_in!=nedges_traversed) 
 	printf("Validation Error: wrong nedge_traversed %llu (correct number is %llu)\n",*nedges_in,nedges_traversed),val_errors++;
 	if(val_errors>0) return 0; else return 1;